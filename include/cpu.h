@@ -2,6 +2,7 @@
 #define CPU_H_INCLUDED
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define ROM_BANK_SIZE 0x4000
@@ -10,6 +11,33 @@
 #define OAM_SIZE 0xA0
 #define IO_REGS_SIZE 0x80
 #define HRAM_SIZE 0x7F
+#define CACHE_LINE_SIZE 64
+#define COVERAGE_MAP_SIZE 0x10000  // Entries in an edge coverage map, a power of 2
+#define ARENA_PAGE_SHIFT 8  // RAM is tracked for state hashing in pages of 256 bytes
+#define IDLE_LOOP_MAX_LENGTH 16  // Longest backward jr checked for idle loops, in bytes
+#define CART_HEADER_END 0x150
+
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 144
+#define CYCLES_PER_FRAME 70224  // t-cycles
+
+// Buttons for cpu_t.joypad. Directions are in the lower nibble, actions in the upper.
+#define JOYPAD_RIGHT 0x01
+#define JOYPAD_LEFT 0x02
+#define JOYPAD_UP 0x04
+#define JOYPAD_DOWN 0x08
+#define JOYPAD_A 0x10
+#define JOYPAD_B 0x20
+#define JOYPAD_SELECT 0x40
+#define JOYPAD_START 0x80
+
+typedef enum {
+  CPU_OK = 0,
+  CPU_ERR_CART_OPEN,     // Cartridge file could not be opened
+  CPU_ERR_CART_READ,     // Cartridge file could not be read
+  CPU_ERR_CART_INVALID,  // Cartridge is too small or of an unsupported type
+  CPU_ERR_NO_MEMORY,     // An allocation failed
+} cpu_err_t;
 
 /**
  * CPU registers
@@ -17,8 +45,8 @@
 #define REGISTER_STRUCT(x, y) \
   typedef union {             \
     struct {                  \
-      uint8_t x;              \
-      uint8_t y;              \
+      uint8_t y;  /* Low */   \
+      uint8_t x;  /* High */  \
     };                        \
     uint16_t reg;             \
   } x##y##_reg_t;
@@ -34,19 +62,25 @@ REGISTERS
 
 typedef union {
   struct {
-    uint8_t : 4;  // Upper 4 bits ignored
-    uint8_t z : 1;
-    uint8_t n : 1;
-    uint8_t h : 1;
+    uint8_t : 4;  // Lower 4 bits ignored
     uint8_t c : 1;
+    uint8_t h : 1;
+    uint8_t n : 1;
+    uint8_t z : 1;
   };
   uint8_t reg;
 } flags_reg_t;
 
+// Masks for the flags register when it is accessed as a whole byte
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
 typedef union {
   struct {
-    uint8_t a;
     flags_reg_t f;
+    uint8_t a;
   };
   uint16_t reg;
 } af_reg_t;
@@ -60,30 +94,76 @@ typedef struct {
   uint16_t pc;  // Program counter
 } cpu_regs_t;
 
+/**
+ * Cartridge contents. Read-only once loaded, so every instance of the same
+ * cartridge shares one copy. The reference count is not atomic: instances
+ * sharing a cart must be set up and cleaned up from one thread.
+ */
+typedef struct {
+  uint8_t* data;  // The entire cartridge, zero padded to at least 2 banks
+  size_t size;    // Size of the cartridge file
+  size_t refs;    // Number of instances using the cart
+} cart_t;
+
+/**
+ * Memory regions. ROM points into the shared cart, and all RAM regions live in
+ * one cache line aligned arena allocated together with the cpu.
+ */
 typedef struct {
-  uint8_t rom_bank_0[ROM_BANK_SIZE];
-  uint8_t rom_bank_N[ROM_BANK_SIZE];
-  uint8_t* cart;  // The entire cartridge
-  uint8_t vram[VRAM_SIZE];
-  uint8_t wram[WRAM_SIZE];
+  const uint8_t* rom_bank_0;
+  const uint8_t* rom_bank_N;
+  uint8_t* io_regs;  // 0xFF00-0xFFFF: IO registers, then HRAM, then IE
+  uint8_t* wram;
+  uint8_t* vram;
+  uint8_t* oam;
   uint8_t*
       eram;  // External ram from cartridge for savestates. Set to NULL if not available
-  uint8_t oam[WRAM_SIZE];
-  uint8_t io_regs[IO_REGS_SIZE];
-  uint8_t hram[HRAM_SIZE];
-  uint8_t ie;  // Interrupt enable register
+  uint64_t* dirty_pages;  // Bitmap of arena pages written since the last state_hash
+  cart_t* cart;           // The entire cartridge
+  uint8_t* arena;         // Backing storage of every RAM region
+  size_t arena_size;      // Size of the arena in bytes
 } cpu_mem_t;
 
+// State at the last short backward jump, used to detect idle loops
+typedef struct {
+  cpu_regs_t regs;
+  uint64_t cycles;
+  uint32_t write_count;
+  bool valid;  // Cleared at every event, since input read by the loop may change
+} idle_loop_t;
+
 /**
- * CPU
+ * CPU. State used by every instruction comes first so that it shares the
+ * first two cache lines with the memory region pointers. State read on every
+ * jump fills the third line, and everything after it is cold.
  */
 typedef struct {
-  cpu_regs_t regs;  // Registers
-  cpu_mem_t mem;    // Memory regions
-  uint64_t cycles;  // Number of t-cycles
-  bool halt;        // If the cpu should halt/stop
-  bool ime;         // Interrupt master enable flag
-} cpu_t;
+  cpu_regs_t regs;       // Registers
+  bool halt;             // If the cpu should halt/stop
+  bool ime;              // Interrupt master enable flag
+  bool fault;            // Set on the first access to an invalid memory location
+  uint8_t joypad;        // Buttons currently held, see JOYPAD_*
+  uint64_t cycles;       // Number of t-cycles
+  struct debugger* dbg;  // Attached debugger, NULL when not debugging
+  uint32_t write_count;  // Number of memory writes so far
+  cpu_mem_t mem;         // Memory regions
+
+  // Jumps: idle loop detection and coverage
+  bool idle_skip;        // Fast-forward idle loops. Clear for cycle accuracy.
+  uint8_t* coverage;     // Edge hit counts (COVERAGE_MAP_SIZE) when fuzzing, NULL otherwise
+  uint64_t next_event;   // First cycle at which memory can change from outside the cpu
+  idle_loop_t idle;
+
+  // Cold state
+  uint64_t idle_cycles;  // Total cycles skipped by fast-forwarding
+  uint16_t fault_addr;   // Address of the faulting access
+  uint16_t fault_pc;     // PC of the faulting instruction
+  uint8_t open_bus;      // Target of faulting accesses
+
+  // State hashing, see hash.h
+  uint64_t* page_hashes;  // Hash of each arena page as of the last state_hash
+  uint64_t ram_hash;      // Combined hash of every arena page
+} __attribute__((aligned(CACHE_LINE_SIZE))) cpu_t;
 
 /**
  * Helper functions
@@ -92,13 +172,40 @@ typedef struct {
 //  Reads a cartridge file into ROM
 void read_file_into_rom(char* file_path, cpu_t* cpu);
 
-// Allocates memory for and sets up the cpu struct at the given pointer
-void init_cpu(cpu_t** cpu, char* cart_file);
+// Reads a cartridge file. The cart starts with a single reference held by the caller.
+cpu_err_t load_cart(const char* cart_file, cart_t** cart);
+
+// Drops a reference to the cart, freeing it once no instance uses it
+void release_cart(cart_t* cart);
+
+// Allocates memory for and sets up the cpu struct at the given pointer. On failure *cpu is set to NULL.
+cpu_err_t init_cpu(cpu_t** cpu, const char* cart_file);
+
+// Like init_cpu, but shares an already loaded cart instead of reading a file
+cpu_err_t init_cpu_from_cart(cpu_t** cpu, cart_t* cart);
 
 // Frees memory related to the CPU
 void cleanup_cpu(cpu_t* cpu);
 
+// Returns the number of bytes used by the instance, not counting the shared cart
+size_t get_cpu_footprint(const cpu_t* cpu);
+
+// Returns a description of the given error
+const char* cpu_strerror(cpu_err_t err);
+
+// Reads 8 bit values from ROM/RAM without side effects. Invalid addresses read as 0xFF.
+uint8_t peek_mem(uint16_t addr, cpu_t* cpu);
+
 // Performs 1 iteration of the fetch-decode-execute cycle
 void perform_cycle(cpu_t* cpu);
 
+// Runs the cpu up to the end of the current frame. Returns false if it faulted or was stopped by the debugger first.
+bool run_frame(cpu_t* cpu);
+
+// Returns the length of an unprefixed instruction in bytes
+uint8_t get_unprefixed_insn_length(uint8_t opcode);
+
+// Returns the number of t-cycles an unprefixed instruction takes
+uint8_t get_unprefixed_insn_cycles(uint8_t opcode);
+
 #endif
\ No newline at end of file
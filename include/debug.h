@@ -0,0 +1,89 @@
+#ifndef DEBUG_H_INCLUDED
+#define DEBUG_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define DEBUG_PAGE_SHIFT 8
+#define DEBUG_PAGES (0x10000 >> DEBUG_PAGE_SHIFT)
+#define DEBUG_MAX_BREAKPOINTS 32
+#define DEBUG_MAX_WATCHPOINTS 32
+
+// Page flags. A page with no flags set never leaves the fast path.
+#define DEBUG_PAGE_BREAK 0x1
+#define DEBUG_PAGE_READ 0x2
+#define DEBUG_PAGE_WRITE 0x4
+
+typedef enum {
+  DEBUG_WATCH_READ = DEBUG_PAGE_READ,
+  DEBUG_WATCH_WRITE = DEBUG_PAGE_WRITE,
+  DEBUG_WATCH_ACCESS = DEBUG_PAGE_READ | DEBUG_PAGE_WRITE,
+} watch_kind_t;
+
+typedef enum {
+  DEBUG_STOP_NONE,
+  DEBUG_STOP_BREAKPOINT,
+  DEBUG_STOP_READ,
+  DEBUG_STOP_WRITE,
+} stop_reason_t;
+
+// Why the cpu stopped. addr is the watched address for watchpoint stops.
+typedef struct {
+  stop_reason_t reason;
+  uint16_t pc;    // PC of the instruction that triggered the stop
+  uint16_t addr;  // Address that was accessed
+} stop_event_t;
+
+typedef struct {
+  uint16_t addr;
+  watch_kind_t kind;
+} watchpoint_t;
+
+/**
+ * Breakpoints and watchpoints for one cpu. The memory bus only looks at
+ * page_flags, so accesses to pages without breakpoints or watchpoints cost a
+ * single byte load. Attach with debug_attach.
+ */
+typedef struct debugger {
+  uint8_t page_flags[DEBUG_PAGES];
+  uint16_t breakpoints[DEBUG_MAX_BREAKPOINTS];
+  size_t breakpoint_count;
+  watchpoint_t watchpoints[DEBUG_MAX_WATCHPOINTS];
+  size_t watchpoint_count;
+  bool stopped;      // perform_cycle does nothing while this is set
+  bool skip_break;   // Step over the breakpoint at the current PC once
+  stop_event_t event;
+} debugger_t;
+
+// Clears the debugger and attaches it to the cpu
+void debug_attach(cpu_t* cpu, debugger_t* dbg);
+
+// Detaches any debugger from the cpu
+void debug_detach(cpu_t* cpu);
+
+// Adds a breakpoint on the given PC. Returns false if there is no room left.
+bool debug_add_breakpoint(debugger_t* dbg, uint16_t pc);
+
+// Removes the breakpoint on the given PC. Returns false if there was none.
+bool debug_remove_breakpoint(debugger_t* dbg, uint16_t pc);
+
+// Adds a watchpoint on the given address. Returns false if there is no room left.
+bool debug_add_watchpoint(debugger_t* dbg, uint16_t addr, watch_kind_t kind);
+
+// Removes all watchpoints on the given address. Returns false if there were none.
+bool debug_remove_watchpoint(debugger_t* dbg, uint16_t addr);
+
+// Resumes a stopped cpu, stepping over a breakpoint at the current PC
+void debug_continue(debugger_t* dbg);
+
+/**
+ * Slow path handlers called by the cpu for pages with flags set. Returns false
+ * if the instruction at pc should not be executed.
+ */
+bool debug_on_fetch(debugger_t* dbg, uint16_t pc);
+void debug_on_access(debugger_t* dbg, uint16_t pc, uint16_t addr,
+                     watch_kind_t kind);
+
+#endif
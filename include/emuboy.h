@@ -0,0 +1,112 @@
+#ifndef EMUBOY_H_INCLUDED
+#define EMUBOY_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EMUBOY_API __attribute__((visibility("default")))
+
+/**
+ * C ABI of libemuboy. A pool runs many instances of the same cartridge and
+ * steps all of them at once across worker threads. No function exits the
+ * process; every failure is returned as an emuboy_err_t.
+ */
+
+typedef enum {
+  EMUBOY_OK = 0,
+  EMUBOY_ERR_ARGS,          // Invalid argument
+  EMUBOY_ERR_NO_MEMORY,     // An allocation failed
+  EMUBOY_ERR_CART_OPEN,     // Cartridge file could not be opened
+  EMUBOY_ERR_CART_READ,     // Cartridge file could not be read
+  EMUBOY_ERR_CART_INVALID,  // Cartridge is too small or of an unsupported type
+  EMUBOY_ERR_THREADS,       // Worker threads or their locks could not be set up
+  EMUBOY_ERR_FAULT,  // At least one instance accessed an invalid memory location
+} emuboy_err_t;
+
+typedef struct emuboy_pool emuboy_pool_t;
+
+// Buttons, or'ed together into the per-instance input byte of emuboy_pool_step
+#define EMUBOY_BUTTON_RIGHT 0x01
+#define EMUBOY_BUTTON_LEFT 0x02
+#define EMUBOY_BUTTON_UP 0x04
+#define EMUBOY_BUTTON_DOWN 0x08
+#define EMUBOY_BUTTON_A 0x10
+#define EMUBOY_BUTTON_B 0x20
+#define EMUBOY_BUTTON_SELECT 0x40
+#define EMUBOY_BUTTON_START 0x80
+
+/**
+ * Creates count instances of the given cartridge. threads is the number of
+ * threads used to step them (including the caller's), or 0 for one per online
+ * processor.
+ */
+EMUBOY_API emuboy_err_t emuboy_pool_create(const char* cart_file, size_t count,
+                                           size_t threads,
+                                           emuboy_pool_t** pool);
+
+// Stops the worker threads and frees every instance
+EMUBOY_API void emuboy_pool_destroy(emuboy_pool_t* pool);
+
+// Returns the number of instances in the pool
+EMUBOY_API size_t emuboy_pool_size(const emuboy_pool_t* pool);
+
+// Returns the number of bytes used per instance, not counting the shared cartridge
+EMUBOY_API size_t emuboy_pool_instance_bytes(const emuboy_pool_t* pool);
+
+/**
+ * Sets the observation returned by emuboy_pool_step: len bytes of the memory
+ * map starting at addr, per instance. Invalid addresses read as 0xFF.
+ */
+EMUBOY_API emuboy_err_t emuboy_pool_set_observation(emuboy_pool_t* pool,
+                                                    uint16_t addr, size_t len);
+
+/**
+ * Enables or disables fast-forwarding through idle loops (on by default).
+ * Instances end every step in the same state either way. Skipping only changes
+ * the emuboy_pool_idle_cycles statistic and the cycle count in the middle of a
+ * frame, which a pool never exposes.
+ */
+EMUBOY_API void emuboy_pool_set_idle_skip(emuboy_pool_t* pool, int enabled);
+
+// Returns the total number of cycles skipped in idle loops by every instance
+EMUBOY_API uint64_t emuboy_pool_idle_cycles(const emuboy_pool_t* pool);
+
+/**
+ * Writes a 64 bit hash of each instance's state (registers and RAM, not the
+ * cycle count) to hashes, which must hold pool size entries. Equal states hash
+ * equally, so this can be used to deduplicate states. Only memory written
+ * since the last call is rehashed.
+ */
+EMUBOY_API void emuboy_pool_state_hashes(emuboy_pool_t* pool,
+                                         uint64_t* hashes);
+
+// Puts instance index back into its power-on state
+EMUBOY_API emuboy_err_t emuboy_pool_reset(emuboy_pool_t* pool, size_t index);
+
+/**
+ * Runs every instance for frames frames. inputs holds one byte of held
+ * buttons per instance (see EMUBOY_BUTTON_*), or may be NULL for none.
+ *
+ * obs must hold pool size * observation length bytes and receives the
+ * observation of instance i at obs + i * len. faults, if not NULL, receives
+ * one byte per instance that is non-zero when the instance has accessed an
+ * invalid memory location. Faulted instances are not stepped again until
+ * they are reset, and EMUBOY_ERR_FAULT is returned while any exist.
+ */
+EMUBOY_API emuboy_err_t emuboy_pool_step(emuboy_pool_t* pool,
+                                         const uint8_t* inputs,
+                                         uint32_t frames, uint8_t* obs,
+                                         uint8_t* faults);
+
+// Returns a description of the given error
+EMUBOY_API const char* emuboy_strerror(emuboy_err_t err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef EXPORT_H_INCLUDED
+#define EXPORT_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define EXPORT_MAGIC 0x42554D45  // "EMUB"
+#define EXPORT_VERSION 1
+#define EXPORT_FRAME_SLOTS 8
+#define EXPORT_AUDIO_SLOTS 16
+#define EXPORT_FRAME_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT)  // One shade per pixel
+#define EXPORT_AUDIO_SAMPLES 1024  // Stereo samples per audio block
+
+typedef struct {
+  uint64_t seq;     // Frame number, set by the producer
+  uint64_t cycles;  // cpu cycle count at the end of the frame
+  uint8_t pixels[EXPORT_FRAME_SIZE];
+} export_frame_t;
+
+typedef struct {
+  uint64_t seq;           // Block number, set by the producer
+  uint32_t sample_count;  // Number of valid stereo samples
+  int16_t samples[EXPORT_AUDIO_SAMPLES * 2];  // Interleaved left/right
+} export_audio_t;
+
+/**
+ * Layout of the shared memory object. Each ring has one producer (the
+ * emulator) and one consumer. The producer writes a slot in place and then
+ * bumps head; the consumer reads the slot in place and then bumps tail. A slot
+ * is only reused once the consumer has released it, so neither side ever
+ * copies or locks. When the consumer falls behind, the producer drops frames
+ * instead of waiting and counts them in dropped.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t frame_slots;
+  uint32_t audio_slots;
+
+  // Head and tail are written by different processes, keep them apart
+  uint64_t frame_head __attribute__((aligned(64)));  // Frames published
+  uint64_t frame_dropped;
+  uint64_t frame_tail __attribute__((aligned(64)));  // Frames released
+  uint64_t audio_head __attribute__((aligned(64)));  // Blocks published
+  uint64_t audio_dropped;
+  uint64_t audio_tail __attribute__((aligned(64)));  // Blocks released
+
+  export_frame_t frames[EXPORT_FRAME_SLOTS] __attribute__((aligned(64)));
+  export_audio_t audio[EXPORT_AUDIO_SLOTS] __attribute__((aligned(64)));
+} export_ring_t;
+
+/**
+ * Producer side
+ */
+
+/**
+ * Creates the shared memory object with the given name (e.g. "/emuboy").
+ * Returns false and sets errno on failure, EEXIST if the name is already in
+ * use by another producer (or was left behind by one that crashed).
+ */
+bool export_create(const char* name, export_ring_t** ring);
+
+// Unmaps and unlinks the shared memory object
+void export_destroy(export_ring_t* ring, const char* name);
+
+// Returns the next free frame slot to render into, or NULL if the consumer has not released one
+export_frame_t* export_acquire_frame(export_ring_t* ring);
+
+// Makes the slot returned by export_acquire_frame visible to the consumer
+void export_publish_frame(export_ring_t* ring);
+
+// Returns the next free audio slot to write into, or NULL if the consumer has not released one
+export_audio_t* export_acquire_audio(export_ring_t* ring);
+
+// Makes the slot returned by export_acquire_audio visible to the consumer
+void export_publish_audio(export_ring_t* ring);
+
+/**
+ * Consumer side
+ */
+
+/**
+ * Maps an existing shared memory object. Returns false and sets errno on
+ * failure. EAGAIN means the producer has created the object but not finished
+ * setting it up, so try again shortly. EPROTO means the object is not a ring
+ * of this version (wrong size or header).
+ */
+bool export_open(const char* name, export_ring_t** ring);
+
+// Unmaps the shared memory object
+void export_close(export_ring_t* ring);
+
+// Returns the oldest published frame that has not been released, or NULL if there is none
+const export_frame_t* export_peek_frame(export_ring_t* ring);
+
+// Gives the slot returned by export_peek_frame back to the producer
+void export_release_frame(export_ring_t* ring);
+
+// Returns the oldest published audio block that has not been released, or NULL if there is none
+const export_audio_t* export_peek_audio(export_ring_t* ring);
+
+// Gives the slot returned by export_peek_audio back to the producer
+void export_release_audio(export_ring_t* ring);
+
+#endif
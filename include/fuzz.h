@@ -0,0 +1,67 @@
+#ifndef FUZZ_H_INCLUDED
+#define FUZZ_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define FUZZ_MAX_INPUT 64  // Frames per input
+#define FUZZ_MAX_CORPUS 1024
+#define FUZZ_MAX_FINDINGS 64
+
+// Joypad state for each frame, run in order from the snapshot
+typedef struct {
+  uint8_t frames[FUZZ_MAX_INPUT];
+  size_t len;
+} fuzz_input_t;
+
+// An input that made the cpu access an invalid memory location
+typedef struct {
+  uint16_t pc;    // PC of the faulting instruction
+  uint16_t addr;  // Address that was accessed
+  fuzz_input_t input;
+} fuzz_finding_t;
+
+/**
+ * In-process, coverage guided fuzzer for joypad input sequences. Every input
+ * runs from a snapshot of the cpu, taken when the fuzzer is set up. Branch
+ * edges are counted in an AFL style map, and inputs that reach new edges or
+ * new hit count buckets are kept in the corpus for further mutation. Invalid
+ * memory accesses end the run and are recorded as findings.
+ */
+typedef struct {
+  cpu_t* cpu;
+  uint8_t* snapshot;  // Copy of the cpu's allocation
+  size_t snapshot_size;
+  uint8_t coverage[COVERAGE_MAP_SIZE];  // Hit counts of the current run
+  uint8_t seen[COVERAGE_MAP_SIZE];      // Hit count buckets seen so far
+  fuzz_input_t corpus[FUZZ_MAX_CORPUS];
+  size_t corpus_count;
+  fuzz_finding_t findings[FUZZ_MAX_FINDINGS];
+  size_t finding_count;
+  size_t edges;    // Number of distinct edges seen
+  uint64_t execs;  // Number of inputs run
+  uint64_t rng;
+} fuzzer_t;
+
+/**
+ * Sets up the fuzzer and snapshots the cpu's current state. The fuzzer owns
+ * the cpu until fuzz_cleanup, and state_hash must not be called on it
+ * meanwhile since the snapshot restore relies on the dirty page bitmap.
+ */
+cpu_err_t fuzz_init(fuzzer_t* fz, cpu_t* cpu, uint64_t seed);
+
+// Frees the snapshot and detaches the coverage map from the cpu
+void fuzz_cleanup(fuzzer_t* fz);
+
+/**
+ * Runs one input from the snapshot. Returns true if it reached new coverage or
+ * a new finding, in which case it has been added to the corpus or findings.
+ */
+bool fuzz_run(fuzzer_t* fz, const fuzz_input_t* input);
+
+// Mutates a corpus entry and runs it. Returns the finding it produced, or NULL.
+const fuzz_finding_t* fuzz_step(fuzzer_t* fz);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef HASH_H_INCLUDED
+#define HASH_H_INCLUDED
+
+#include <stdint.h>
+#include "cpu.h"
+
+/**
+ * Returns a 64 bit hash of the machine state: registers, halt/ime and every
+ * RAM region. The cycle count is left out so that the same state reached at
+ * different times hashes the same. Only arena pages written since the last
+ * call are rehashed, so the cost follows the number of dirty pages.
+ */
+uint64_t state_hash(cpu_t* cpu);
+
+// Returns the same value as state_hash, but rehashes every page and leaves the cache untouched
+uint64_t state_hash_full(const cpu_t* cpu);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef LOCKSTEP_H_INCLUDED
+#define LOCKSTEP_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define LOCKSTEP_MAX_LANES 64
+
+/**
+ * Runs many instances of the same ROM side by side. Registers are kept in
+ * struct-of-arrays form (one array per register, one element per lane) so
+ * that an opcode shared by every lane at the same PC is executed by a single
+ * loop over the lanes, which the compiler turns into SIMD code. Lanes whose PC
+ * differs from the group being executed simply wait their turn, and opcodes
+ * without a lane kernel fall back to perform_cycle on the backing cpu_t.
+ */
+typedef struct {
+  // r8[i] holds register i for every lane, indexed by the r8 placeholder
+  // (b, c, d, e, h, l, unused, a)
+  uint8_t r8[8][LOCKSTEP_MAX_LANES] __attribute__((aligned(64)));
+  uint8_t f[LOCKSTEP_MAX_LANES] __attribute__((aligned(64)));
+  uint16_t sp[LOCKSTEP_MAX_LANES] __attribute__((aligned(64)));
+  uint16_t pc[LOCKSTEP_MAX_LANES] __attribute__((aligned(64)));
+  uint64_t cycles[LOCKSTEP_MAX_LANES] __attribute__((aligned(64)));
+  uint8_t mask[LOCKSTEP_MAX_LANES] __attribute__((aligned(64)));
+  cpu_t* cpus[LOCKSTEP_MAX_LANES];  // Backing instances (memory, flags)
+  size_t lanes;                     // Number of lanes in use
+  uint64_t vector_insns;  // Instructions executed by the lane kernels
+  uint64_t scalar_insns;  // Instructions executed through perform_cycle
+} lockstep_t;
+
+/**
+ * Loads the registers of the given instances into the lockstep engine. All
+ * instances must be running the same ROM. Returns false if there are too many
+ * instances or their ROMs differ.
+ */
+bool lockstep_init(lockstep_t* ls, cpu_t** cpus, size_t count);
+
+/**
+ * Executes one instruction for every lane that shares the PC of the lane that
+ * is furthest behind. Lanes whose instance has faulted, or whose debugger has
+ * stopped it, are left alone like run_frame would. Returns the number of
+ * instructions executed, which is 0 once every lane is stopped.
+ */
+size_t lockstep_step(lockstep_t* ls);
+
+// Writes the lane registers back into the backing cpu_t instances
+void lockstep_sync(lockstep_t* ls);
+
+#endif
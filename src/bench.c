@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/cpu.h"
+#include "../include/hash.h"
+#include "../include/lockstep.h"
+
+#define BENCH_INSTANCES 32
+#define BENCH_INSNS_PER_INSTANCE 200000
+#define BENCH_HASH_FRAMES 600
+#define BENCH_IDLE_FRAMES 600
+
+// Returns the current monotonic time in seconds
+static double now_secs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Creates count instances sharing the given cartridge
+static void init_instances(cpu_t** cpus, size_t count, cart_t* cart) {
+  for (size_t i = 0; i < count; i++) {
+    const cpu_err_t err = init_cpu_from_cart(&cpus[i], cart);
+    if (err != CPU_OK) {
+      fprintf(stderr, "Could not set up instance: %s\n", cpu_strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void cleanup_instances(cpu_t** cpus, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    cleanup_cpu(cpus[i]);
+  }
+}
+
+// Reports the memory used per instance
+static void bench_footprint(cart_t* cart) {
+  cpu_t* cpu;
+  init_instances(&cpu, 1, cart);
+  printf("bytes per instance: %zu (cpu_t %zu, RAM arena %zu), shared ROM %zu\n",
+         get_cpu_footprint(cpu), sizeof(cpu_t), cpu->mem.arena_size,
+         cart->size);
+  cleanup_instances(&cpu, 1);
+}
+
+// Compares incremental state hashing against rehashing everything after each frame
+static void bench_hash(cart_t* cart) {
+  cpu_t* cpu;
+  init_instances(&cpu, 1, cart);
+  const size_t pages = cpu->mem.arena_size >> ARENA_PAGE_SHIFT;
+  double incremental_secs = 0;
+  double full_secs = 0;
+  uint64_t dirty = 0;
+
+  state_hash(cpu);
+  for (size_t frame = 0; frame < BENCH_HASH_FRAMES; frame++) {
+    run_frame(cpu);
+    for (size_t word = 0; word * 64 < pages; word++) {
+      dirty += __builtin_popcountll(cpu->mem.dirty_pages[word]);
+    }
+
+    double start = now_secs();
+    const uint64_t hash = state_hash(cpu);
+    incremental_secs += now_secs() - start;
+
+    start = now_secs();
+    const uint64_t full_hash = state_hash_full(cpu);
+    full_secs += now_secs() - start;
+
+    if (hash != full_hash) {
+      fprintf(stderr, "Incremental hash differs from full hash\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  cleanup_instances(&cpu, 1);
+
+  printf("state_hash over %d frames, %.1f of %zu pages dirty per frame\n",
+         BENCH_HASH_FRAMES, (double)dirty / BENCH_HASH_FRAMES, pages);
+  printf("incremental:   %.0f ns/hash\n",
+         incremental_secs / BENCH_HASH_FRAMES * 1e9);
+  printf("full:          %.0f ns/hash\n", full_secs / BENCH_HASH_FRAMES * 1e9);
+}
+
+/**
+ * Checks that fast-forwarding idle loops does not change behaviour: an
+ * instance with idle skipping and an accurate one get the same input each
+ * frame, and must end every frame with the same registers, RAM and cycles.
+ */
+static void bench_idle(cart_t* cart) {
+  cpu_t* cpus[2];
+  init_instances(cpus, 2, cart);
+  cpus[1]->idle_skip = false;
+  uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+  for (size_t frame = 0; frame < BENCH_IDLE_FRAMES; frame++) {
+    // Buttons are held for single frames at irregular intervals
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    const uint8_t joypad = (rng & 3) == 0 ? (uint8_t)(rng >> 8) : 0;
+
+    for (size_t i = 0; i < 2; i++) {
+      cpus[i]->joypad = joypad;
+      run_frame(cpus[i]);
+    }
+
+    if (cpus[0]->cycles != cpus[1]->cycles ||
+        state_hash_full(cpus[0]) != state_hash_full(cpus[1])) {
+      fprintf(stderr, "Idle skipping diverged from accurate run in frame %zu\n",
+              frame);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printf("idle skip over %d frames: %llu of %llu cycles skipped, same state\n",
+         BENCH_IDLE_FRAMES, (unsigned long long)cpus[0]->idle_cycles,
+         (unsigned long long)cpus[0]->cycles);
+  cleanup_instances(cpus, 2);
+}
+
+/**
+ * Gives each instance different registers and held buttons, so that lanes
+ * take different branches and the lockstep engine has to split them up
+ */
+static void diverge_instances(cpu_t** cpus, size_t count) {
+  uint64_t rng = 0x2545F4914F6CDD1Dull;
+  for (size_t i = 0; i < count; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    cpus[i]->regs.bc.reg = (uint16_t)rng;
+    cpus[i]->regs.de.reg = (uint16_t)(rng >> 16);
+    cpus[i]->regs.af.a = (uint8_t)(rng >> 32);
+    cpus[i]->joypad = (uint8_t)(rng >> 40);
+  }
+}
+
+/**
+ * Checks that the lane kernels match perform_cycle: every lane must end in
+ * the same state as an instance run on its own up to the lane's cycle count.
+ */
+static void check_lockstep(cart_t* cart, cpu_t** lanes, bool divergent) {
+  cpu_t* cpus[BENCH_INSTANCES];
+  init_instances(cpus, BENCH_INSTANCES, cart);
+  if (divergent) {
+    diverge_instances(cpus, BENCH_INSTANCES);
+  }
+
+  for (size_t i = 0; i < BENCH_INSTANCES; i++) {
+    while (cpus[i]->cycles < lanes[i]->cycles && !cpus[i]->fault) {
+      perform_cycle(cpus[i]);
+    }
+
+    if (cpus[i]->cycles != lanes[i]->cycles ||
+        cpus[i]->fault != lanes[i]->fault ||
+        memcmp(&cpus[i]->regs, &lanes[i]->regs, sizeof(cpu_regs_t)) != 0 ||
+        state_hash_full(cpus[i]) != state_hash_full(lanes[i])) {
+      fprintf(stderr,
+              "Lockstep lane %zu diverged from perform_cycle (PC 0x%04X vs "
+              "0x%04X)\n",
+              i, lanes[i]->regs.pc, cpus[i]->regs.pc);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  cleanup_instances(cpus, BENCH_INSTANCES);
+}
+
+/**
+ * Compares independent perform_cycle instances against the lockstep engine.
+ * Identical instances never diverge, which is the engine's best case, so a
+ * divergent workload is measured as well.
+ */
+static void bench_lockstep(cart_t* cart, bool divergent) {
+  cpu_t* cpus[BENCH_INSTANCES];
+  const uint64_t total = (uint64_t)BENCH_INSTANCES * BENCH_INSNS_PER_INSTANCE;
+
+  init_instances(cpus, BENCH_INSTANCES, cart);
+  if (divergent) {
+    diverge_instances(cpus, BENCH_INSTANCES);
+  }
+  double start = now_secs();
+  uint64_t scalar_executed = 0;
+  for (size_t n = 0; n < BENCH_INSNS_PER_INSTANCE; n++) {
+    for (size_t i = 0; i < BENCH_INSTANCES; i++) {
+      if (!cpus[i]->fault) {
+        perform_cycle(cpus[i]);
+        scalar_executed++;
+      }
+    }
+  }
+  const double scalar_secs = now_secs() - start;
+  cleanup_instances(cpus, BENCH_INSTANCES);
+
+  init_instances(cpus, BENCH_INSTANCES, cart);
+  if (divergent) {
+    diverge_instances(cpus, BENCH_INSTANCES);
+  }
+  static lockstep_t ls;
+  if (!lockstep_init(&ls, cpus, BENCH_INSTANCES)) {
+    fprintf(stderr, "Could not set up lockstep engine\n");
+    exit(EXIT_FAILURE);
+  }
+
+  start = now_secs();
+  uint64_t executed = 0;
+  uint64_t steps = 0;
+  while (executed < total) {
+    const size_t count = lockstep_step(&ls);
+    if (count == 0) {
+      break;  // Every lane has faulted
+    }
+    executed += count;
+    steps++;
+  }
+  lockstep_sync(&ls);
+  const double lockstep_secs = now_secs() - start;
+  size_t faulted = 0;
+  for (size_t i = 0; i < BENCH_INSTANCES; i++) {
+    faulted += cpus[i]->fault;
+  }
+  check_lockstep(cart, cpus, divergent);
+  cleanup_instances(cpus, BENCH_INSTANCES);
+
+  printf("%s: %d instances, %d instructions each, %zu faulted\n",
+         divergent ? "divergent lanes" : "identical lanes", BENCH_INSTANCES,
+         BENCH_INSNS_PER_INSTANCE, faulted);
+  printf("perform_cycle: %.0f insns/s\n", scalar_executed / scalar_secs);
+  printf("lockstep:      %.0f insns/s (%.1f%% in lane kernels, %.1f lanes per "
+         "step)\n",
+         executed / lockstep_secs,
+         executed ? 100.0 * ls.vector_insns / executed : 0.0,
+         steps ? (double)executed / steps : 0.0);
+  printf("speedup:       %.2fx\n",
+         (executed / lockstep_secs) / (scalar_executed / scalar_secs));
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <cartridge>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  cart_t* cart;
+  const cpu_err_t err = load_cart(argv[1], &cart);
+  if (err != CPU_OK) {
+    fprintf(stderr, "Could not load %s: %s\n", argv[1], cpu_strerror(err));
+    return EXIT_FAILURE;
+  }
+
+  bench_footprint(cart);
+  bench_hash(cart);
+  bench_idle(cart);
+  bench_lockstep(cart, false);
+  bench_lockstep(cart, true);
+  release_cart(cart);
+  return 0;
+}
@@ -1,8 +1,10 @@
+#define _POSIX_C_SOURCE 200112L
 
 #include "../include/cpu.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "../include/debug.h"
 #include "../include/utils.h"
 
 // Consider the opcode's bits as XXYYZZZZ, where XX is the opcode
@@ -83,7 +85,7 @@ static uint8_t get_prefixed_insn_cycles(uint8_t opcode) {
  * Returns the total length of the instruction given the opcode. This does not handle 0xCB 
  * prefixed instructions.
  */
-static uint8_t get_unprefixed_insn_length(uint8_t opcode) {
+uint8_t get_unprefixed_insn_length(uint8_t opcode) {
   switch (opcode) {
     // 3-byte instructions
     case 0x01:  // LD BC, d16
@@ -139,7 +141,12 @@ static uint8_t get_unprefixed_insn_length(uint8_t opcode) {
   }
 }
 
-// Provides a pointer to position in RAM. Exits if address is invalid memory location.
+// Returns the number of t-cycles an unprefixed instruction takes
+uint8_t get_unprefixed_insn_cycles(uint8_t opcode) {
+  return OP_CYCLES[opcode];
+}
+
+// Provides a pointer to position in RAM. Returns NULL if address is invalid memory location.
 static uint8_t* get_ram_ptr(const uint16_t addr, cpu_mem_t* mem) {
   if (addr >= 0x8000 && addr <= 0x9FFF) {
     return &mem->vram[addr - 0x8000];
@@ -149,16 +156,45 @@ static uint8_t* get_ram_ptr(const uint16_t addr, cpu_mem_t* mem) {
     return &mem->wram[addr - 0xC000];
   } else if (addr >= 0xFE00 && addr <= 0xFE9F) {
     return &mem->oam[addr - 0xFE00];
-  } else if (addr >= 0xFF00 && addr <= 0xFF7F) {
+  } else if (addr >= 0xFF00) {  // IO registers, HRAM and IE are contiguous
     return &mem->io_regs[addr - 0xFF00];
-  } else if (addr >= 0xFF80 && addr <= 0xFFFE) {
-    return &mem->hram[addr - 0xFF80];
-  } else if (addr == 0xFFFF) {
-    return &mem->ie;
   }
 
-  PERRORF("Attempted to access invalid memory location 0x%04X", addr);
-  exit(EXIT_FAILURE);
+  return NULL;
+}
+
+/**
+ * Like get_ram_ptr, but records a fault on the cpu for invalid memory locations
+ * instead of returning NULL. Reads then see 0xFF and writes are discarded.
+ */
+static uint8_t* get_bus_ptr(const uint16_t addr, cpu_t* cpu) {
+  uint8_t* ptr = get_ram_ptr(addr, &cpu->mem);
+  if (ptr != NULL) {
+    return ptr;
+  }
+
+  if (!cpu->fault) {
+    cpu->fault = true;
+    cpu->fault_addr = addr;
+    cpu->fault_pc = cpu->regs.pc;
+  }
+  cpu->open_bus = 0xFF;
+  return &cpu->open_bus;
+}
+
+// Returns the value of the joypad register given the buttons currently held
+static uint8_t read_joypad(const cpu_t* cpu) {
+  const uint8_t select = cpu->mem.io_regs[0] & 0x30;
+  uint8_t buttons = 0x0F;  // A cleared bit means the button is held
+
+  if ((select & 0x10) == 0) {
+    buttons &= ~(cpu->joypad & 0x0F);
+  }
+  if ((select & 0x20) == 0) {
+    buttons &= ~(cpu->joypad >> 4);
+  }
+
+  return 0xC0 | select | buttons;
 }
 
 // Returns a pointer to the flags struct of the given cpu
@@ -166,22 +202,64 @@ static flags_reg_t* get_flags_ptr(cpu_t* cpu) {
   return &cpu->regs.af.f;
 }
 
-// Reads 8 bit values from ROM/RAM.
-static uint8_t read_mem(const uint16_t addr, cpu_mem_t mem) {
+// Reads 8 bit values from ROM/RAM for instruction fetches. Not seen by watchpoints.
+static uint8_t fetch_mem(const uint16_t addr, cpu_t* cpu) {
   if (addr <= 0x3FFF) {
-    return mem.rom_bank_0[addr];
+    return cpu->mem.rom_bank_0[addr];
   } else if (addr >= 0x4000 && addr <= 0x7FFF) {
-    return mem.rom_bank_N[addr - 0x4000];
+    return cpu->mem.rom_bank_N[addr - 0x4000];
+  } else if (addr == 0xFF00) {
+    return read_joypad(cpu);
+  }
+
+  // This will record a fault if address is invalid
+  return *get_bus_ptr(addr, cpu);
+}
+
+// Reads 8 bit values from ROM/RAM.
+static uint8_t read_mem(const uint16_t addr, cpu_t* cpu) {
+  if (cpu->dbg != NULL &&
+      (cpu->dbg->page_flags[addr >> DEBUG_PAGE_SHIFT] & DEBUG_PAGE_READ)) {
+    debug_on_access(cpu->dbg, cpu->regs.pc, addr, DEBUG_WATCH_READ);
+  }
+
+  return fetch_mem(addr, cpu);
+}
+
+// Reads 8 bit values from ROM/RAM without side effects. Invalid addresses read as 0xFF.
+uint8_t peek_mem(uint16_t addr, cpu_t* cpu) {
+  if (addr <= 0x7FFF || addr == 0xFF00) {
+    return fetch_mem(addr, cpu);
   }
 
-  // This will exit if address is invalid
-  return *get_ram_ptr(addr, &mem);
+  const uint8_t* ptr = get_ram_ptr(addr, &cpu->mem);
+  return ptr != NULL ? *ptr : 0xFF;
+}
+
+// Writes 8 bit values to RAM.
+static void write_mem(const uint16_t addr, const uint8_t val, cpu_t* cpu) {
+  if (cpu->dbg != NULL &&
+      (cpu->dbg->page_flags[addr >> DEBUG_PAGE_SHIFT] & DEBUG_PAGE_WRITE)) {
+    debug_on_access(cpu->dbg, cpu->regs.pc, addr, DEBUG_WATCH_WRITE);
+  }
+
+  // This will record a fault if address is invalid
+  uint8_t* ptr = get_bus_ptr(addr, cpu);
+  *ptr = val;
+  cpu->write_count++;
+
+  // Faulting writes land in the cpu, which sits before the arena
+  const size_t offset = ptr - cpu->mem.arena;
+  if (offset < cpu->mem.arena_size) {
+    const size_t page = offset >> ARENA_PAGE_SHIFT;
+    cpu->mem.dirty_pages[page / 64] |= 1ull << (page % 64);
+  }
 }
 
 // Updates the PC by the length of the current instruction, and updates the cycle count
 void update_cpu(uint8_t opcode, cpu_t* cpu) {
   if (opcode == 0xCB) {
-    uint8_t prefixed_opcode = read_mem(cpu->regs.pc + 1, cpu->mem);
+    uint8_t prefixed_opcode = fetch_mem(cpu->regs.pc + 1, cpu);
     cpu->regs.pc += 2;
     cpu->cycles += get_prefixed_insn_cycles(prefixed_opcode);
   } else {
@@ -191,100 +269,185 @@ void update_cpu(uint8_t opcode, cpu_t* cpu) {
   }
 }
 
-// Reads the cart into memory banks and the cart member
-void read_cart_into_mem(char* file_path, cpu_mem_t* cpu_mem) {
-  FILE* file = fopen(file_path, "rb");
+// Reads a cartridge file. The cart starts with a single reference held by the caller.
+cpu_err_t load_cart(const char* cart_file, cart_t** cart) {
+  FILE* file = fopen(cart_file, "rb");
   if (file == NULL) {
-    perror("Could not find file");
-    exit(EXIT_FAILURE);
+    return CPU_ERR_CART_OPEN;
   }
 
   if (fseek(file, 0, SEEK_END) != 0) {
     fclose(file);
-    perror("Failed to find file size");
-    exit(EXIT_FAILURE);
+    return CPU_ERR_CART_READ;
   }
 
   const long file_size = ftell(file);
   if (file_size == -1) {
     fclose(file);
-    perror("Failed to find file size");
-    exit(EXIT_FAILURE);
+    return CPU_ERR_CART_READ;
+  }
+  if (file_size < CART_HEADER_END) {
+    fclose(file);
+    return CPU_ERR_CART_INVALID;
   }
   rewind(file);
 
-  // Clear out rom banks first
-  memset(cpu_mem->rom_bank_N, 0, ROM_BANK_SIZE);
-  memset(cpu_mem->rom_bank_0, 0, ROM_BANK_SIZE);
-  cpu_mem->cart = calloc(1, file_size);
+  // Pad small carts so both banks can always be read in full
+  const size_t data_size =
+      file_size > 2 * ROM_BANK_SIZE ? file_size : 2 * ROM_BANK_SIZE;
+  cart_t* cart_ptr = calloc(1, sizeof(cart_t));
+  if (cart_ptr != NULL) {
+    cart_ptr->data = calloc(1, data_size);
+  }
+  if (cart_ptr == NULL || cart_ptr->data == NULL) {
+    free(cart_ptr);
+    fclose(file);
+    return CPU_ERR_NO_MEMORY;
+  }
 
-  if (fread(cpu_mem->cart, file_size, 1, file) != 1) {
+  if (fread(cart_ptr->data, file_size, 1, file) != 1) {
+    free(cart_ptr->data);
+    free(cart_ptr);
     fclose(file);
-    perror("Failed to read cartridge into memory");
-    exit(EXIT_FAILURE);
+    return CPU_ERR_CART_READ;
   }
   fclose(file);
 
-  const size_t bank0_size =
-      file_size > ROM_BANK_SIZE ? ROM_BANK_SIZE : file_size;
-  memcpy(cpu_mem->rom_bank_0, cpu_mem->cart, bank0_size);
+  cart_ptr->size = file_size;
+  cart_ptr->refs = 1;
+  *cart = cart_ptr;
+
+  return CPU_OK;
+}
 
-  if (file_size > ROM_BANK_SIZE) {
-    size_t remainder = file_size - ROM_BANK_SIZE;
-    const size_t bankN_size =
-        remainder < ROM_BANK_SIZE ? remainder : ROM_BANK_SIZE;
-    memcpy(cpu_mem->rom_bank_N, cpu_mem->cart + bank0_size, bankN_size);
+// Drops a reference to the cart, freeing it once no instance uses it
+void release_cart(cart_t* cart) {
+  if (--cart->refs == 0) {
+    free(cart->data);
+    free(cart);
   }
 }
 
+// Offsets of the RAM regions within the arena, most frequently used first
+#define ARENA_IO_REGS 0x0  // IO registers, HRAM and IE
+#define ARENA_OAM 0x100
+#define ARENA_WRAM 0x200
+#define ARENA_VRAM (ARENA_WRAM + WRAM_SIZE)
+#define ARENA_ERAM (ARENA_VRAM + VRAM_SIZE)
+
 // Allocates memory for and sets up the cpu struct at the given pointer
-void init_cpu(cpu_t** cpu, char* cart_file) {
-  *cpu = calloc(1, sizeof(cpu_t));
-  cpu_t* cpu_ptr = *cpu;
-  cpu_ptr->halt = false;
+cpu_err_t init_cpu(cpu_t** cpu, const char* cart_file) {
+  cart_t* cart;
+  cpu_err_t err = load_cart(cart_file, &cart);
+  if (err != CPU_OK) {
+    *cpu = NULL;
+    return err;
+  }
 
-  // Memory
-  read_cart_into_mem(cart_file, &cpu_ptr->mem);
-  const uint8_t eram_type = cpu_ptr->mem.cart[0x0149];
+  // The instance takes its own reference, so drop the one from load_cart
+  err = init_cpu_from_cart(cpu, cart);
+  release_cart(cart);
+  return err;
+}
+
+// Sets up a cpu using an already loaded cart
+cpu_err_t init_cpu_from_cart(cpu_t** cpu, cart_t* cart) {
+  *cpu = NULL;
+  const uint8_t eram_type = cart->data[0x0149];
   size_t eram_size = 0;
 
   switch (eram_type) {
     case 0x0:
-      cpu_ptr->mem.eram = NULL;
       break;
     case 0x2:
-      eram_size = 8 * 1000;
+      eram_size = 8 * 1024;
       break;
     case 0x3:
-      eram_size = 32 * 1000;
+      eram_size = 32 * 1024;
       break;
     case 0x4:
-      eram_size = 128 * 1000;
+      eram_size = 128 * 1024;
       break;
     case 0x5:
-      eram_size = 64 * 1000;
+      eram_size = 64 * 1024;
       break;
     default:
-      PERRORF("Unexpected SRAM/ERAM type: 0x%04X", eram_type);
-      exit(EXIT_FAILURE);
+      return CPU_ERR_CART_INVALID;
   }
-  if (eram_size != 0) {
-    cpu_ptr->mem.eram = malloc(eram_size);  // Placeholder lol
+
+  // The cpu, its RAM arena and the state hashing bookkeeping share one
+  // allocation. The arena starts on the cache line after the cpu.
+  const size_t arena_size = ARENA_ERAM + eram_size;
+  const size_t pages = arena_size >> ARENA_PAGE_SHIFT;
+  const size_t dirty_words = (pages + 63) / 64;
+  const size_t block_size =
+      sizeof(cpu_t) + arena_size + (dirty_words + pages) * sizeof(uint64_t);
+  void* block;
+  if (posix_memalign(&block, CACHE_LINE_SIZE, block_size) != 0) {
+    return CPU_ERR_NO_MEMORY;
   }
+  memset(block, 0, block_size);
+  cpu_t* cpu_ptr = block;
+  cpu_ptr->halt = false;
+  cpu_ptr->idle_skip = true;
+
+  // Memory
+  cpu_mem_t* mem = &cpu_ptr->mem;
+  cart->refs++;
+  mem->cart = cart;
+  mem->rom_bank_0 = cart->data;
+  mem->rom_bank_N = cart->data + ROM_BANK_SIZE;
+  mem->arena = (uint8_t*)block + sizeof(cpu_t);
+  mem->arena_size = arena_size;
+  mem->io_regs = mem->arena + ARENA_IO_REGS;
+  mem->oam = mem->arena + ARENA_OAM;
+  mem->wram = mem->arena + ARENA_WRAM;
+  mem->vram = mem->arena + ARENA_VRAM;
+  mem->eram = eram_size != 0 ? mem->arena + ARENA_ERAM : NULL;
+  mem->dirty_pages = (uint64_t*)(mem->arena + arena_size);
+  cpu_ptr->page_hashes = mem->dirty_pages + dirty_words;
+
+  // Nothing has been hashed yet
+  memset(mem->dirty_pages, 0xFF, dirty_words * sizeof(uint64_t));
 
   // Registers
   cpu_ptr->regs.pc = 0x0100;
+
+  *cpu = cpu_ptr;
+  return CPU_OK;
 }
 
 void cleanup_cpu(cpu_t* cpu) {
-  if (cpu->mem.eram != NULL) {
-    free(cpu->mem.eram);
-  }
-
-  free(cpu->mem.cart);
+  release_cart(cpu->mem.cart);
   free(cpu);
 }
 
+// Returns the number of bytes used by the instance, not counting the shared cart
+size_t get_cpu_footprint(const cpu_t* cpu) {
+  const size_t pages = cpu->mem.arena_size >> ARENA_PAGE_SHIFT;
+  const size_t dirty_words = (pages + 63) / 64;
+  return sizeof(cpu_t) + cpu->mem.arena_size +
+         (dirty_words + pages) * sizeof(uint64_t);
+}
+
+// Returns a description of the given error
+const char* cpu_strerror(cpu_err_t err) {
+  switch (err) {
+    case CPU_OK:
+      return "Success";
+    case CPU_ERR_CART_OPEN:
+      return "Could not open cartridge";
+    case CPU_ERR_CART_READ:
+      return "Failed to read cartridge into memory";
+    case CPU_ERR_CART_INVALID:
+      return "Unsupported or invalid cartridge";
+    case CPU_ERR_NO_MEMORY:
+      return "Out of memory";
+    default:
+      return "Unknown error";
+  }
+}
+
 /**
  * Translates r16 placeholder to register value pointer. Exits if YY 
  * is not recognized
@@ -363,17 +526,17 @@ static uint16_t get_r16mem_val(uint8_t YY, cpu_t* cpu) {
  * if successful, or -1 if out of bounds. This assumes that the opcode is 8 bits long, and 
  * that the address was originally stored in little-endian.
  */
-static uint16_t get_imm16(const uint16_t op_addr, const cpu_mem_t mem) {
+static uint16_t get_imm16(const uint16_t op_addr, cpu_t* cpu) {
   // Upper and lower in big endian
-  uint8_t lower = read_mem(op_addr + 1, mem);
-  uint8_t upper = read_mem(op_addr + 2, mem);
+  uint8_t lower = fetch_mem(op_addr + 1, cpu);
+  uint8_t upper = fetch_mem(op_addr + 2, cpu);
 
   return (upper << 8) | lower;
 }
 
 /**
  * Returns the associated r8 pointer based on the given placeholder. "bits" should be a 
- * 3 bit value.
+ * 3 bit value, and not 6 ([hl]), which has to go through get_r8/set_r8.
  * */
 
 static uint8_t* get_r8_ptr(const uint8_t bits, cpu_t* cpu) {
@@ -390,9 +553,6 @@ static uint8_t* get_r8_ptr(const uint8_t bits, cpu_t* cpu) {
       return &cpu->regs.hl.h;
     case 5:
       return &cpu->regs.hl.l;
-    case 6:
-      const uint16_t hl = cpu->regs.hl.reg;
-      return get_ram_ptr(hl, &cpu->mem);
     case 7:
       return &cpu->regs.af.a;
     default:
@@ -401,12 +561,29 @@ static uint8_t* get_r8_ptr(const uint8_t bits, cpu_t* cpu) {
   }
 }
 
+// Reads the r8 register (or [hl]) for the given 3 bit placeholder
+static uint8_t get_r8(const uint8_t bits, cpu_t* cpu) {
+  if (bits == 6) {
+    return read_mem(cpu->regs.hl.reg, cpu);
+  }
+  return *get_r8_ptr(bits, cpu);
+}
+
+// Writes the r8 register (or [hl]) for the given 3 bit placeholder
+static void set_r8(const uint8_t bits, const uint8_t val, cpu_t* cpu) {
+  if (bits == 6) {
+    write_mem(cpu->regs.hl.reg, val, cpu);
+  } else {
+    *get_r8_ptr(bits, cpu) = val;
+  }
+}
+
 // Handles block zero instructions identified uniquely by their last 4 bits/nibble.
 static bool handle_block0_4bit_opcodes(opcode_t opcode_data, cpu_t* cpu) {
   switch (opcode_data.ZZZZ) {
     case 0b0001: {  // ld r16, imm16
       uint16_t* reg_ptr = get_r16_ptr(opcode_data.YY, cpu);
-      const uint16_t imm16 = get_imm16(cpu->regs.pc, cpu->mem);
+      const uint16_t imm16 = get_imm16(cpu->regs.pc, cpu);
       DBG_PRINT("ld r16 (%d) 0x%04X", opcode_data.YY, imm16);
 
       *reg_ptr = imm16;
@@ -415,24 +592,17 @@ static bool handle_block0_4bit_opcodes(opcode_t opcode_data, cpu_t* cpu) {
     case 0b0010: {  // ld [r16mem], a
       r16mem_ptr_t reg_data = get_r16mem_ptr(opcode_data.YY, cpu);
       DBG_PRINT("ld [0x%04X], 0x%02X", *reg_data.r16mem_ptr, cpu->regs.af.a);
-      *reg_data.r16mem_ptr = cpu->regs.af.a;
+      write_mem(*reg_data.r16mem_ptr, cpu->regs.af.a, cpu);
       *reg_data.r16mem_ptr += reg_data.post_op;
       break;
     }
     case 0b1010: {  // ld a, [r16mem]
       const uint16_t addr = get_r16mem_val(opcode_data.YY, cpu);
-      const uint8_t val = read_mem(addr, cpu->mem);
+      const uint8_t val = read_mem(addr, cpu);
       DBG_PRINT("ld a, [0x%04X]", addr);
       cpu->regs.af.a = val;
       break;
     }
-    case 0b1000: {  // ld [imm16], sp
-      const uint16_t addr = get_imm16(cpu->regs.pc, cpu->mem);
-      uint8_t* ram_ptr = get_ram_ptr(addr, &cpu->mem);
-      DBG_PRINT("ld [0x%04X], 0x%04X", addr, cpu->regs.sp);
-      *ram_ptr = cpu->regs.sp;
-      break;
-    }
     case 0b0011: {  // inc r16
       DBG_PRINT("inc r16 (%d)", opcode_data.YY);
       uint16_t* r16_ptr = get_r16_ptr(opcode_data.YY, cpu);
@@ -468,13 +638,13 @@ static bool handle_block0_4bit_opcodes(opcode_t opcode_data, cpu_t* cpu) {
 }
 
 // Gets the immediate 8 bit value after the opcode at the given address
-static int8_t get_imm8(const uint16_t op_addr, const cpu_mem_t mem) {
-  return read_mem(op_addr + 1, mem);
+static int8_t get_imm8(const uint16_t op_addr, cpu_t* cpu) {
+  return fetch_mem(op_addr + 1, cpu);
 }
 
 // Checks if the given condition is met. cond should not be more than 2 bits wide.
-static bool is_cond_met(const uint8_t cond, const cpu_t cpu) {
-  flags_reg_t flags = cpu.regs.af.f;
+static bool is_cond_met(const uint8_t cond, const cpu_t* cpu) {
+  flags_reg_t flags = cpu->regs.af.f;
   switch (cond) {
     case 0: {  // nz
       return flags.z == 0;
@@ -493,47 +663,94 @@ static bool is_cond_met(const uint8_t cond, const cpu_t cpu) {
   }
 }
 
+// Counts a branch from the instruction at pc to target in the coverage map, if there is one
+static void record_edge(const uint16_t pc, const uint16_t target, cpu_t* cpu) {
+  if (cpu->coverage == NULL) {
+    return;
+  }
+
+  // There is no MBC yet, so 0x4000-0x7FFF is always bank 1
+  const uint32_t bank = (pc >= 0x4000 && pc <= 0x7FFF) ? 1 : 0;
+  uint32_t key = ((bank << 16) | pc) * 0x9E3779B1u ^ target * 0x85EBCA6Bu;
+  key ^= key >> 16;
+  cpu->coverage[key & (COVERAGE_MAP_SIZE - 1)]++;
+}
+
+/**
+ * Called before a taken jr. If the jump closes a short loop, and a whole
+ * iteration went by without changing a register or writing to memory, every
+ * following iteration is identical until something outside the cpu changes
+ * memory. The iterations up to the next such event are skipped in one go.
+ */
+static void check_idle_loop(const int8_t offset, cpu_t* cpu) {
+  if (offset >= 0 || offset < -IDLE_LOOP_MAX_LENGTH || !cpu->idle_skip ||
+      cpu->dbg != NULL || cpu->next_event <= cpu->cycles) {
+    return;
+  }
+
+  idle_loop_t* idle = &cpu->idle;
+  if (idle->valid && idle->write_count == cpu->write_count &&
+      memcmp(&idle->regs, &cpu->regs, sizeof(cpu_regs_t)) == 0) {
+    const uint64_t iteration = cpu->cycles - idle->cycles;
+    // Stop short of the event, the jump itself still has to run before it
+    const uint64_t skipped =
+        (cpu->next_event - cpu->cycles - 1) / iteration * iteration;
+    cpu->cycles += skipped;
+    cpu->idle_cycles += skipped;
+  }
+
+  idle->regs = cpu->regs;
+  idle->cycles = cpu->cycles;
+  idle->write_count = cpu->write_count;
+  idle->valid = true;
+}
+
 static bool handle_block0_3bit_opcodes(opcode_t opcode_data, cpu_t* cpu) {
   flags_reg_t* flags = get_flags_ptr(cpu);
 
   switch (opcode_data.ZZZ) {
     case 0b100: {  // inc r8
       DBG_PRINT("inc r8 (%d)", opcode_data.YYZ);
-      uint8_t* r8_ptr = get_r8_ptr(opcode_data.YYZ, cpu);
-      bool set_h = (*r8_ptr & 0xF) ==
-                   0xF;  // If lower nibble is 0xF, there will be a carry
+      const uint8_t val = get_r8(opcode_data.YYZ, cpu) + 1;
+      bool set_h = (val & 0xF) ==
+                   0;  // If lower nibble was 0xF, there was a carry
 
-      (*r8_ptr)++;
+      set_r8(opcode_data.YYZ, val, cpu);
 
-      flags->z = (*r8_ptr == 0) ? 1 : 0;
+      flags->z = (val == 0) ? 1 : 0;
       flags->n = 0;
       flags->h = (int)set_h;
       break;
     }
     case 0b101: {  // dec r8
       DBG_PRINT("dec r8 (%d)", opcode_data.YYZ);
-      uint8_t* r8_ptr = get_r8_ptr(opcode_data.YYZ, cpu);
-      bool set_h = ((*r8_ptr) & 0xF) == 0;
-      (*r8_ptr)--;
+      const uint8_t old = get_r8(opcode_data.YYZ, cpu);
+      const uint8_t val = old - 1;
+      bool set_h = (old & 0xF) == 0;
+      set_r8(opcode_data.YYZ, val, cpu);
 
-      flags->z = (*r8_ptr == 0) ? 1 : 0;
+      flags->z = (val == 0) ? 1 : 0;
       flags->n = 1;
       flags->h = (int)set_h;
       break;
     }
     case 0b110: {  // ld r8, imm8
-      const uint8_t imm8 = get_imm8(cpu->regs.pc, cpu->mem);
+      const uint8_t imm8 = get_imm8(cpu->regs.pc, cpu);
       DBG_PRINT("ld r8 (%d), 0x%02X", opcode_data.YYZ, imm8);
-      uint8_t* r8 = get_r8_ptr(opcode_data.YYZ, cpu);
-      *r8 = imm8;
+      set_r8(opcode_data.YYZ, imm8, cpu);
 
       break;
     }
     case 0b000: {  // jr cond, imm8
       const uint8_t cond = (opcode_data.opcode >> 3) & 0b11;
-      if (is_cond_met(cond, *cpu)) {
-        const int8_t imm8 = get_imm8(cpu->regs.pc, cpu->mem);
+      const uint16_t next_pc = cpu->regs.pc + 2;
+      if (is_cond_met(cond, cpu)) {
+        const int8_t imm8 = get_imm8(cpu->regs.pc, cpu);
+        record_edge(cpu->regs.pc, next_pc + imm8, cpu);
+        check_idle_loop(imm8, cpu);
         cpu->regs.pc += imm8;
+      } else {
+        record_edge(cpu->regs.pc, next_pc, cpu);
       }
       break;
     }
@@ -554,6 +771,13 @@ static bool handle_block0_8bit_opcodes(uint8_t opcode, cpu_t* cpu) {
       DBG_PRINT("nop");
       break;
     }
+    case 0x08: {  // ld [imm16], sp
+      const uint16_t addr = get_imm16(cpu->regs.pc, cpu);
+      DBG_PRINT("ld [0x%04X], 0x%04X", addr, cpu->regs.sp);
+      write_mem(addr, cpu->regs.sp & 0xFF, cpu);
+      write_mem(addr + 1, cpu->regs.sp >> 8, cpu);
+      break;
+    }
     case 0x07:    // rlca
     case 0x0F: {  // rrca
       uint8_t carry_bit;
@@ -646,8 +870,10 @@ static bool handle_block0_8bit_opcodes(uint8_t opcode, cpu_t* cpu) {
       break;
     }
     case 0x18: {                                             // jr imm8
-      const int8_t imm8 = get_imm8(cpu->regs.pc, cpu->mem);  // Signed value
+      const int8_t imm8 = get_imm8(cpu->regs.pc, cpu);  // Signed value
       DBG_PRINT("jr 0x%04X", imm8);
+      record_edge(cpu->regs.pc, cpu->regs.pc + 2 + imm8, cpu);
+      check_idle_loop(imm8, cpu);
       cpu->regs.pc += imm8;
       break;
     }
@@ -682,16 +908,23 @@ static void do_block1_insns(const opcode_t opcode_data, cpu_t* cpu) {
   }
 
   // ld r8, r8
-  uint8_t* dest = get_r8_ptr(opcode_data.YYZ, cpu);
-  uint8_t* src = get_r8_ptr(opcode_data.ZZZ, cpu);
-  *dest = *src;
+  set_r8(opcode_data.YYZ, get_r8(opcode_data.ZZZ, cpu), cpu);
 }
 
 /**
  * Performs 1 cycle of the fetch-decode-execute cycle.
  */
 void perform_cycle(cpu_t* cpu) {
-  uint8_t opcode = read_mem(cpu->regs.pc, cpu->mem);
+  // Breakpoints only leave the fast path on pages that have one
+  debugger_t* dbg = cpu->dbg;
+  if (dbg != NULL &&
+      (dbg->stopped || dbg->skip_break ||
+       (dbg->page_flags[cpu->regs.pc >> DEBUG_PAGE_SHIFT] & DEBUG_PAGE_BREAK)) &&
+      !debug_on_fetch(dbg, cpu->regs.pc)) {
+    return;
+  }
+
+  uint8_t opcode = fetch_mem(cpu->regs.pc, cpu);
 
   // Consider the opcode's bits as XXYYZZZZ
   uint8_t XX = (opcode >> 6);
@@ -701,16 +934,17 @@ void perform_cycle(cpu_t* cpu) {
       .YY = YY,
       .ZZZZ = ZZZZ,
       .YYZ = (YY << 1) | ((opcode >> 3) & 0b1),
-      .ZZZ = ZZZZ >> 1,
+      .ZZZ = opcode & 0b111,
       .opcode = opcode,
   };
 
   // Each helper increments the PC
   switch (XX) {  // Identify block
-    case 1:
+    case 0:
       do_block0_insns(opcode_data, cpu);
       break;
-    case 2:
+    case 1:
+      do_block1_insns(opcode_data, cpu);
       break;
     default:
       update_cpu(0, cpu);
@@ -718,4 +952,22 @@ void perform_cycle(cpu_t* cpu) {
   }
 
   update_cpu(opcode, cpu);
-}
\ No newline at end of file
+}
+// Runs the cpu up to the end of the current frame
+bool run_frame(cpu_t* cpu) {
+  const uint64_t frame_end =
+      (cpu->cycles / CYCLES_PER_FRAME + 1) * CYCLES_PER_FRAME;
+  // Joypad input only changes between frames. An iteration seen in the last
+  // frame may have read the old input, so it does not prove the loop is idle.
+  cpu->next_event = frame_end;
+  cpu->idle.valid = false;
+
+  while (cpu->cycles < frame_end) {
+    if (cpu->fault || (cpu->dbg != NULL && cpu->dbg->stopped)) {
+      return false;
+    }
+    perform_cycle(cpu);
+  }
+
+  return true;
+}
@@ -0,0 +1,126 @@
+#include "../include/debug.h"
+#include <string.h>
+
+// Recomputes the page flags from the breakpoint and watchpoint lists
+static void update_page_flags(debugger_t* dbg) {
+  memset(dbg->page_flags, 0, DEBUG_PAGES);
+  for (size_t i = 0; i < dbg->breakpoint_count; i++) {
+    dbg->page_flags[dbg->breakpoints[i] >> DEBUG_PAGE_SHIFT] |=
+        DEBUG_PAGE_BREAK;
+  }
+  for (size_t i = 0; i < dbg->watchpoint_count; i++) {
+    const watchpoint_t* wp = &dbg->watchpoints[i];
+    dbg->page_flags[wp->addr >> DEBUG_PAGE_SHIFT] |= wp->kind;
+  }
+}
+
+void debug_attach(cpu_t* cpu, debugger_t* dbg) {
+  memset(dbg, 0, sizeof(*dbg));
+  cpu->dbg = dbg;
+}
+
+void debug_detach(cpu_t* cpu) {
+  cpu->dbg = NULL;
+}
+
+bool debug_add_breakpoint(debugger_t* dbg, uint16_t pc) {
+  if (dbg->breakpoint_count == DEBUG_MAX_BREAKPOINTS) {
+    return false;
+  }
+
+  dbg->breakpoints[dbg->breakpoint_count++] = pc;
+  update_page_flags(dbg);
+  return true;
+}
+
+bool debug_remove_breakpoint(debugger_t* dbg, uint16_t pc) {
+  for (size_t i = 0; i < dbg->breakpoint_count; i++) {
+    if (dbg->breakpoints[i] == pc) {
+      dbg->breakpoints[i] = dbg->breakpoints[--dbg->breakpoint_count];
+      update_page_flags(dbg);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool debug_add_watchpoint(debugger_t* dbg, uint16_t addr, watch_kind_t kind) {
+  if (dbg->watchpoint_count == DEBUG_MAX_WATCHPOINTS) {
+    return false;
+  }
+
+  dbg->watchpoints[dbg->watchpoint_count++] = (watchpoint_t){
+      .addr = addr,
+      .kind = kind,
+  };
+  update_page_flags(dbg);
+  return true;
+}
+
+bool debug_remove_watchpoint(debugger_t* dbg, uint16_t addr) {
+  bool removed = false;
+  size_t i = 0;
+  while (i < dbg->watchpoint_count) {
+    if (dbg->watchpoints[i].addr == addr) {
+      dbg->watchpoints[i] = dbg->watchpoints[--dbg->watchpoint_count];
+      removed = true;
+    } else {
+      i++;
+    }
+  }
+
+  update_page_flags(dbg);
+  return removed;
+}
+
+void debug_continue(debugger_t* dbg) {
+  if (dbg->event.reason == DEBUG_STOP_BREAKPOINT) {
+    dbg->skip_break = true;
+  }
+  dbg->stopped = false;
+  dbg->event.reason = DEBUG_STOP_NONE;
+}
+
+bool debug_on_fetch(debugger_t* dbg, uint16_t pc) {
+  if (dbg->stopped) {
+    return false;
+  }
+
+  if (dbg->skip_break) {
+    dbg->skip_break = false;
+    return true;
+  }
+
+  for (size_t i = 0; i < dbg->breakpoint_count; i++) {
+    if (dbg->breakpoints[i] == pc) {
+      dbg->stopped = true;
+      dbg->event = (stop_event_t){
+          .reason = DEBUG_STOP_BREAKPOINT,
+          .pc = pc,
+          .addr = pc,
+      };
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void debug_on_access(debugger_t* dbg, uint16_t pc, uint16_t addr,
+                     watch_kind_t kind) {
+  for (size_t i = 0; i < dbg->watchpoint_count; i++) {
+    const watchpoint_t* wp = &dbg->watchpoints[i];
+    if (wp->addr == addr && (wp->kind & kind)) {
+      // The access completes, the cpu stops before the next instruction
+      dbg->stopped = true;
+      dbg->event = (stop_event_t){
+          .reason =
+              kind == DEBUG_WATCH_READ ? DEBUG_STOP_READ : DEBUG_STOP_WRITE,
+          .pc = pc,
+          .addr = addr,
+      };
+      return;
+    }
+  }
+}
@@ -0,0 +1,335 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/emuboy.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../include/cpu.h"
+#include "../include/hash.h"
+
+// The input byte is passed to the core unchanged
+#if EMUBOY_BUTTON_RIGHT != JOYPAD_RIGHT || EMUBOY_BUTTON_LEFT != JOYPAD_LEFT || \
+    EMUBOY_BUTTON_UP != JOYPAD_UP || EMUBOY_BUTTON_DOWN != JOYPAD_DOWN ||     \
+    EMUBOY_BUTTON_A != JOYPAD_A || EMUBOY_BUTTON_B != JOYPAD_B ||             \
+    EMUBOY_BUTTON_SELECT != JOYPAD_SELECT || EMUBOY_BUTTON_START != JOYPAD_START
+#error "EMUBOY_BUTTON_* must match JOYPAD_* in cpu.h"
+#endif
+
+typedef struct {
+  emuboy_pool_t* pool;
+  size_t index;  // Which share of the instances this worker steps
+  pthread_t thread;
+} worker_t;
+
+struct emuboy_pool {
+  cpu_t** cpus;
+  size_t count;
+  cart_t* cart;  // Shared by every instance, kept for resets
+  uint16_t obs_addr;
+  size_t obs_len;
+  bool idle_skip;
+
+  // workers[0] is the calling thread, the others are started at creation
+  worker_t* workers;
+  size_t thread_count;
+  size_t started;  // Number of threads actually started
+  pthread_mutex_t lock;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  uint64_t generation;  // Bumped for every step
+  size_t pending;       // Workers still busy with the current step
+  bool quit;
+
+  // Arguments of the current step
+  const uint8_t* inputs;
+  uint32_t frames;
+  uint8_t* obs;
+};
+
+static emuboy_err_t from_cpu_err(cpu_err_t err) {
+  switch (err) {
+    case CPU_OK:
+      return EMUBOY_OK;
+    case CPU_ERR_CART_OPEN:
+      return EMUBOY_ERR_CART_OPEN;
+    case CPU_ERR_CART_READ:
+      return EMUBOY_ERR_CART_READ;
+    case CPU_ERR_CART_INVALID:
+      return EMUBOY_ERR_CART_INVALID;
+    case CPU_ERR_NO_MEMORY:
+    default:
+      return EMUBOY_ERR_NO_MEMORY;
+  }
+}
+
+// Steps the worker's share of the instances with the current step arguments
+static void step_share(emuboy_pool_t* pool, size_t index) {
+  const size_t first = pool->count * index / pool->thread_count;
+  const size_t last = pool->count * (index + 1) / pool->thread_count;
+
+  for (size_t i = first; i < last; i++) {
+    cpu_t* cpu = pool->cpus[i];
+    cpu->joypad = pool->inputs != NULL ? pool->inputs[i] : 0;
+
+    for (uint32_t frame = 0; frame < pool->frames && !cpu->fault; frame++) {
+      run_frame(cpu);
+    }
+
+    uint8_t* obs = pool->obs + i * pool->obs_len;
+    for (size_t j = 0; j < pool->obs_len; j++) {
+      obs[j] = peek_mem((uint16_t)(pool->obs_addr + j), cpu);
+    }
+  }
+}
+
+static void* worker_main(void* arg) {
+  worker_t* worker = arg;
+  emuboy_pool_t* pool = worker->pool;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (pool->generation == seen && !pool->quit) {
+      pthread_cond_wait(&pool->start_cond, &pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    step_share(pool, worker->index);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->done_cond);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+emuboy_err_t emuboy_pool_create(const char* cart_file, size_t count,
+                                size_t threads, emuboy_pool_t** pool) {
+  if (cart_file == NULL || count == 0 || pool == NULL) {
+    return EMUBOY_ERR_ARGS;
+  }
+
+  if (threads == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (size_t)online : 1;
+  }
+  if (threads > count) {
+    threads = count;
+  }
+
+  emuboy_pool_t* p = calloc(1, sizeof(emuboy_pool_t));
+  if (p == NULL) {
+    return EMUBOY_ERR_NO_MEMORY;
+  }
+  // emuboy_pool_destroy needs the lock and conditions, so they come first
+  if (pthread_mutex_init(&p->lock, NULL) != 0) {
+    free(p);
+    return EMUBOY_ERR_THREADS;
+  }
+  if (pthread_cond_init(&p->start_cond, NULL) != 0) {
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return EMUBOY_ERR_THREADS;
+  }
+  if (pthread_cond_init(&p->done_cond, NULL) != 0) {
+    pthread_cond_destroy(&p->start_cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return EMUBOY_ERR_THREADS;
+  }
+  *pool = p;
+  p->thread_count = threads;
+  p->started = 1;
+  p->idle_skip = true;
+
+  p->cpus = calloc(count, sizeof(cpu_t*));
+  p->workers = calloc(threads, sizeof(worker_t));
+  if (p->cpus == NULL || p->workers == NULL) {
+    emuboy_pool_destroy(p);
+    *pool = NULL;
+    return EMUBOY_ERR_NO_MEMORY;
+  }
+
+  cpu_err_t err = load_cart(cart_file, &p->cart);
+  if (err != CPU_OK) {
+    emuboy_pool_destroy(p);
+    *pool = NULL;
+    return from_cpu_err(err);
+  }
+
+  for (; p->count < count; p->count++) {
+    err = init_cpu_from_cart(&p->cpus[p->count], p->cart);
+    if (err != CPU_OK) {
+      emuboy_pool_destroy(p);
+      *pool = NULL;
+      return from_cpu_err(err);
+    }
+  }
+
+  for (size_t i = 0; i < threads; i++) {
+    p->workers[i].pool = p;
+    p->workers[i].index = i;
+  }
+  for (; p->started < threads; p->started++) {
+    worker_t* worker = &p->workers[p->started];
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+      emuboy_pool_destroy(p);
+      *pool = NULL;
+      return EMUBOY_ERR_THREADS;
+    }
+  }
+
+  return EMUBOY_OK;
+}
+
+void emuboy_pool_destroy(emuboy_pool_t* pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 1; i < pool->started; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  for (size_t i = 0; i < pool->count; i++) {
+    cleanup_cpu(pool->cpus[i]);
+  }
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->start_cond);
+  pthread_mutex_destroy(&pool->lock);
+  if (pool->cart != NULL) {
+    release_cart(pool->cart);
+  }
+  free(pool->workers);
+  free(pool->cpus);
+  free(pool);
+}
+
+size_t emuboy_pool_size(const emuboy_pool_t* pool) {
+  return pool->count;
+}
+
+size_t emuboy_pool_instance_bytes(const emuboy_pool_t* pool) {
+  return get_cpu_footprint(pool->cpus[0]);
+}
+
+emuboy_err_t emuboy_pool_set_observation(emuboy_pool_t* pool, uint16_t addr,
+                                         size_t len) {
+  if (len > 0x10000) {
+    return EMUBOY_ERR_ARGS;
+  }
+
+  pool->obs_addr = addr;
+  pool->obs_len = len;
+  return EMUBOY_OK;
+}
+
+void emuboy_pool_set_idle_skip(emuboy_pool_t* pool, int enabled) {
+  pool->idle_skip = enabled != 0;
+  for (size_t i = 0; i < pool->count; i++) {
+    pool->cpus[i]->idle_skip = pool->idle_skip;
+  }
+}
+
+uint64_t emuboy_pool_idle_cycles(const emuboy_pool_t* pool) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < pool->count; i++) {
+    total += pool->cpus[i]->idle_cycles;
+  }
+  return total;
+}
+
+void emuboy_pool_state_hashes(emuboy_pool_t* pool, uint64_t* hashes) {
+  for (size_t i = 0; i < pool->count; i++) {
+    hashes[i] = state_hash(pool->cpus[i]);
+  }
+}
+
+emuboy_err_t emuboy_pool_reset(emuboy_pool_t* pool, size_t index) {
+  if (index >= pool->count) {
+    return EMUBOY_ERR_ARGS;
+  }
+
+  cpu_t* cpu;
+  const cpu_err_t err = init_cpu_from_cart(&cpu, pool->cart);
+  if (err != CPU_OK) {
+    return from_cpu_err(err);
+  }
+
+  cpu->idle_skip = pool->idle_skip;
+  cleanup_cpu(pool->cpus[index]);
+  pool->cpus[index] = cpu;
+  return EMUBOY_OK;
+}
+
+emuboy_err_t emuboy_pool_step(emuboy_pool_t* pool, const uint8_t* inputs,
+                              uint32_t frames, uint8_t* obs, uint8_t* faults) {
+  if (obs == NULL && pool->obs_len != 0) {
+    return EMUBOY_ERR_ARGS;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->inputs = inputs;
+  pool->frames = frames;
+  pool->obs = obs;
+  pool->pending = pool->thread_count - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  step_share(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  emuboy_err_t result = EMUBOY_OK;
+  for (size_t i = 0; i < pool->count; i++) {
+    if (faults != NULL) {
+      faults[i] = pool->cpus[i]->fault;
+    }
+    if (pool->cpus[i]->fault) {
+      result = EMUBOY_ERR_FAULT;
+    }
+  }
+
+  return result;
+}
+
+const char* emuboy_strerror(emuboy_err_t err) {
+  switch (err) {
+    case EMUBOY_OK:
+      return "Success";
+    case EMUBOY_ERR_ARGS:
+      return "Invalid argument";
+    case EMUBOY_ERR_NO_MEMORY:
+      return cpu_strerror(CPU_ERR_NO_MEMORY);
+    case EMUBOY_ERR_CART_OPEN:
+      return cpu_strerror(CPU_ERR_CART_OPEN);
+    case EMUBOY_ERR_CART_READ:
+      return cpu_strerror(CPU_ERR_CART_READ);
+    case EMUBOY_ERR_CART_INVALID:
+      return cpu_strerror(CPU_ERR_CART_INVALID);
+    case EMUBOY_ERR_THREADS:
+      return "Could not start worker threads";
+    case EMUBOY_ERR_FAULT:
+      return "Attempted to access invalid memory location";
+    default:
+      return "Unknown error";
+  }
+}
@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/export.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+// Maps the shared memory object behind fd and closes fd
+static export_ring_t* map_ring(int fd) {
+  void* addr = mmap(NULL, sizeof(export_ring_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  const int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+bool export_create(const char* name, export_ring_t** ring) {
+  // Never take over an existing object, a consumer may still have it mapped
+  const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) {
+    return false;
+  }
+
+  // The object is zero filled, so only the header needs to be set
+  if (ftruncate(fd, sizeof(export_ring_t)) == -1) {
+    const int saved_errno = errno;
+    close(fd);
+    shm_unlink(name);
+    errno = saved_errno;
+    return false;
+  }
+
+  *ring = map_ring(fd);
+  if (*ring == NULL) {
+    const int saved_errno = errno;
+    shm_unlink(name);
+    errno = saved_errno;
+    return false;
+  }
+
+  (*ring)->version = EXPORT_VERSION;
+  (*ring)->frame_slots = EXPORT_FRAME_SLOTS;
+  (*ring)->audio_slots = EXPORT_AUDIO_SLOTS;
+  // Consumers check the magic last, once everything else is in place
+  STORE_RELEASE(&(*ring)->magic, EXPORT_MAGIC);
+
+  return true;
+}
+
+void export_destroy(export_ring_t* ring, const char* name) {
+  munmap(ring, sizeof(export_ring_t));
+  shm_unlink(name);
+}
+
+export_frame_t* export_acquire_frame(export_ring_t* ring) {
+  const uint64_t head = ring->frame_head;
+  if (head - LOAD_ACQUIRE(&ring->frame_tail) == EXPORT_FRAME_SLOTS) {
+    ring->frame_dropped++;
+    return NULL;
+  }
+
+  return &ring->frames[head % EXPORT_FRAME_SLOTS];
+}
+
+void export_publish_frame(export_ring_t* ring) {
+  STORE_RELEASE(&ring->frame_head, ring->frame_head + 1);
+}
+
+export_audio_t* export_acquire_audio(export_ring_t* ring) {
+  const uint64_t head = ring->audio_head;
+  if (head - LOAD_ACQUIRE(&ring->audio_tail) == EXPORT_AUDIO_SLOTS) {
+    ring->audio_dropped++;
+    return NULL;
+  }
+
+  return &ring->audio[head % EXPORT_AUDIO_SLOTS];
+}
+
+void export_publish_audio(export_ring_t* ring) {
+  STORE_RELEASE(&ring->audio_head, ring->audio_head + 1);
+}
+
+bool export_open(const char* name, export_ring_t** ring) {
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    return false;
+  }
+
+  // Mapping past the end of the object would fault on the first access. The
+  // producer creates it empty and sizes it right after.
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    const int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return false;
+  }
+  if ((size_t)st.st_size != sizeof(export_ring_t)) {
+    close(fd);
+    errno = st.st_size == 0 ? EAGAIN : EPROTO;
+    return false;
+  }
+
+  *ring = map_ring(fd);
+  if (*ring == NULL) {
+    return false;
+  }
+
+  // The magic is stored last, so 0 means the producer is still setting up
+  const uint32_t magic = LOAD_ACQUIRE(&(*ring)->magic);
+  if (magic != EXPORT_MAGIC || (*ring)->version != EXPORT_VERSION) {
+    export_close(*ring);
+    errno = magic == 0 ? EAGAIN : EPROTO;
+    return false;
+  }
+
+  return true;
+}
+
+void export_close(export_ring_t* ring) {
+  munmap(ring, sizeof(export_ring_t));
+}
+
+const export_frame_t* export_peek_frame(export_ring_t* ring) {
+  const uint64_t tail = ring->frame_tail;
+  if (tail == LOAD_ACQUIRE(&ring->frame_head)) {
+    return NULL;
+  }
+
+  return &ring->frames[tail % EXPORT_FRAME_SLOTS];
+}
+
+void export_release_frame(export_ring_t* ring) {
+  STORE_RELEASE(&ring->frame_tail, ring->frame_tail + 1);
+}
+
+const export_audio_t* export_peek_audio(export_ring_t* ring) {
+  const uint64_t tail = ring->audio_tail;
+  if (tail == LOAD_ACQUIRE(&ring->audio_head)) {
+    return NULL;
+  }
+
+  return &ring->audio[tail % EXPORT_AUDIO_SLOTS];
+}
+
+void export_release_audio(export_ring_t* ring) {
+  STORE_RELEASE(&ring->audio_tail, ring->audio_tail + 1);
+}
@@ -0,0 +1,191 @@
+#include "../include/fuzz.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../include/hash.h"
+
+static uint64_t next_random(fuzzer_t* fz) {
+  // xorshift64
+  fz->rng ^= fz->rng << 13;
+  fz->rng ^= fz->rng >> 7;
+  fz->rng ^= fz->rng << 17;
+  return fz->rng;
+}
+
+// Maps a hit count to AFL's buckets (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+)
+static uint8_t bucket(uint8_t hits) {
+  if (hits <= 3) {
+    return hits == 3 ? 4 : hits;
+  }
+  if (hits < 8) {
+    return 8;
+  }
+  if (hits < 16) {
+    return 16;
+  }
+  if (hits < 32) {
+    return 32;
+  }
+  return hits < 128 ? 64 : 128;
+}
+
+/**
+ * Puts the cpu back into its snapshot state. Only arena pages written since
+ * the snapshot (per the dirty page bitmap) are copied back, so a reset costs
+ * about as much as the memory the input actually touched.
+ */
+static void restore_snapshot(fuzzer_t* fz) {
+  cpu_t* cpu = fz->cpu;
+  const size_t arena_size = cpu->mem.arena_size;
+  const size_t pages = arena_size >> ARENA_PAGE_SHIFT;
+  uint64_t* dirty = cpu->mem.dirty_pages;
+  const uint8_t* saved_arena = fz->snapshot + sizeof(cpu_t);
+
+  for (size_t word = 0; word * 64 < pages; word++) {
+    while (dirty[word] != 0) {
+      const size_t page = word * 64 + __builtin_ctzll(dirty[word]);
+      dirty[word] &= dirty[word] - 1;
+      if (page >= pages) {
+        continue;
+      }
+
+      const size_t offset = page << ARENA_PAGE_SHIFT;
+      memcpy(cpu->mem.arena + offset, saved_arena + offset,
+             (size_t)1 << ARENA_PAGE_SHIFT);
+    }
+  }
+
+  memcpy(cpu, fz->snapshot, sizeof(cpu_t));
+}
+
+// Folds the current run's hit counts into seen. Returns true if any bucket is new.
+static bool merge_coverage(fuzzer_t* fz) {
+  bool is_new = false;
+  for (size_t i = 0; i < COVERAGE_MAP_SIZE; i++) {
+    if (fz->coverage[i] == 0) {
+      continue;
+    }
+
+    const uint8_t hit = bucket(fz->coverage[i]);
+    if ((fz->seen[i] & hit) == 0) {
+      if (fz->seen[i] == 0) {
+        fz->edges++;
+      }
+      fz->seen[i] |= hit;
+      is_new = true;
+    }
+  }
+
+  memset(fz->coverage, 0, sizeof(fz->coverage));
+  return is_new;
+}
+
+// Records a fault as a finding, unless the same access was already found
+static bool add_finding(fuzzer_t* fz, const fuzz_input_t* input) {
+  const cpu_t* cpu = fz->cpu;
+  for (size_t i = 0; i < fz->finding_count; i++) {
+    if (fz->findings[i].pc == cpu->fault_pc &&
+        fz->findings[i].addr == cpu->fault_addr) {
+      return false;
+    }
+  }
+  if (fz->finding_count == FUZZ_MAX_FINDINGS) {
+    return false;
+  }
+
+  fuzz_finding_t* finding = &fz->findings[fz->finding_count++];
+  finding->pc = cpu->fault_pc;
+  finding->addr = cpu->fault_addr;
+  finding->input = *input;
+  return true;
+}
+
+cpu_err_t fuzz_init(fuzzer_t* fz, cpu_t* cpu, uint64_t seed) {
+  memset(fz, 0, sizeof(fuzzer_t));
+  fz->cpu = cpu;
+  fz->rng = seed != 0 ? seed : 0x2545F4914F6CDD1Dull;
+
+  // Clear the dirty bitmap so it only tracks writes made after the snapshot
+  cpu->coverage = fz->coverage;
+  state_hash(cpu);
+
+  fz->snapshot_size = get_cpu_footprint(cpu);
+  fz->snapshot = malloc(fz->snapshot_size);
+  if (fz->snapshot == NULL) {
+    cpu->coverage = NULL;
+    return CPU_ERR_NO_MEMORY;
+  }
+  memcpy(fz->snapshot, cpu, fz->snapshot_size);
+
+  // A single frame with no buttons held seeds the corpus
+  fz->corpus[0].len = 1;
+  fz->corpus_count = 1;
+  return CPU_OK;
+}
+
+void fuzz_cleanup(fuzzer_t* fz) {
+  if (fz->cpu != NULL) {
+    fz->cpu->coverage = NULL;
+  }
+  free(fz->snapshot);
+  fz->snapshot = NULL;
+}
+
+bool fuzz_run(fuzzer_t* fz, const fuzz_input_t* input) {
+  cpu_t* cpu = fz->cpu;
+  restore_snapshot(fz);
+  fz->execs++;
+
+  for (size_t frame = 0; frame < input->len && !cpu->fault; frame++) {
+    cpu->joypad = input->frames[frame];
+    run_frame(cpu);
+  }
+
+  const bool new_finding = cpu->fault && add_finding(fz, input);
+  const bool new_coverage = merge_coverage(fz);
+  if (new_coverage && fz->corpus_count < FUZZ_MAX_CORPUS) {
+    fz->corpus[fz->corpus_count++] = *input;
+  }
+
+  return new_finding || new_coverage;
+}
+
+const fuzz_finding_t* fuzz_step(fuzzer_t* fz) {
+  fuzz_input_t input = fz->corpus[next_random(fz) % fz->corpus_count];
+  const uint64_t mutations = 1 + next_random(fz) % 4;
+
+  for (uint64_t i = 0; i < mutations; i++) {
+    const uint64_t r = next_random(fz);
+    const size_t pos = input.len != 0 ? (r >> 8) % input.len : 0;
+
+    switch (r % 4) {
+      case 0:  // Flip a button
+        if (input.len != 0) {
+          input.frames[pos] ^= 1 << ((r >> 32) % 8);
+          break;
+        }
+        // fall through
+      case 1:  // Append a random frame
+        if (input.len < FUZZ_MAX_INPUT) {
+          input.frames[input.len++] = (uint8_t)(r >> 32);
+        }
+        break;
+      case 2:  // Insert a copy of a frame, holding its buttons for longer
+        if (input.len != 0 && input.len < FUZZ_MAX_INPUT) {
+          memmove(&input.frames[pos + 1], &input.frames[pos], input.len - pos);
+          input.len++;
+        }
+        break;
+      case 3:  // Delete a frame
+        if (input.len != 0) {
+          memmove(&input.frames[pos], &input.frames[pos + 1],
+                  input.len - pos - 1);
+          input.len--;
+        }
+        break;
+    }
+  }
+
+  const size_t findings = fz->finding_count;
+  fuzz_run(fz, &input);
+  return fz->finding_count > findings ? &fz->findings[findings] : NULL;
+}
@@ -0,0 +1,80 @@
+#include "../include/hash.h"
+#include <string.h>
+
+#define ARENA_PAGE_SIZE (1 << ARENA_PAGE_SHIFT)
+#define PRIME_1 0x9E3779B97F4A7C15ull
+#define PRIME_2 0xC2B2AE3D27D4EB4Full
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Final avalanche, taken from MurmurHash3's fmix64
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDull;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+// Hashes len bytes, 8 at a time. len must be a multiple of 8.
+static uint64_t hash_words(const uint8_t* data, size_t len, uint64_t seed) {
+  uint64_t h = seed * PRIME_1 + len;
+  for (size_t i = 0; i < len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    h = rotl64(h ^ (word * PRIME_1), 31) * PRIME_2;
+  }
+
+  return mix64(h);
+}
+
+// Hash of one arena page. The page index is the seed so equal pages at different addresses differ.
+static uint64_t hash_page(const cpu_t* cpu, size_t page) {
+  return hash_words(cpu->mem.arena + (page << ARENA_PAGE_SHIFT),
+                    ARENA_PAGE_SIZE, page + 1);
+}
+
+// Combines the hash of every arena page with the cpu state outside of RAM
+static uint64_t combine(const cpu_t* cpu, uint64_t ram_hash) {
+  uint8_t regs[16] = {0};
+  memcpy(regs, &cpu->regs, sizeof(cpu_regs_t));
+  regs[sizeof(cpu_regs_t)] = cpu->halt;
+  regs[sizeof(cpu_regs_t) + 1] = cpu->ime;
+
+  return mix64(ram_hash ^ hash_words(regs, sizeof(regs), 0));
+}
+
+uint64_t state_hash(cpu_t* cpu) {
+  const size_t pages = cpu->mem.arena_size >> ARENA_PAGE_SHIFT;
+  uint64_t* dirty = cpu->mem.dirty_pages;
+
+  for (size_t word = 0; word * 64 < pages; word++) {
+    while (dirty[word] != 0) {
+      const size_t page = word * 64 + __builtin_ctzll(dirty[word]);
+      dirty[word] &= dirty[word] - 1;
+      if (page >= pages) {
+        continue;
+      }
+
+      // Pages are combined with xor, so a page can be swapped out on its own
+      const uint64_t page_hash = hash_page(cpu, page);
+      cpu->ram_hash ^= cpu->page_hashes[page] ^ page_hash;
+      cpu->page_hashes[page] = page_hash;
+    }
+  }
+
+  return combine(cpu, cpu->ram_hash);
+}
+
+uint64_t state_hash_full(const cpu_t* cpu) {
+  const size_t pages = cpu->mem.arena_size >> ARENA_PAGE_SHIFT;
+  uint64_t ram_hash = 0;
+  for (size_t page = 0; page < pages; page++) {
+    ram_hash ^= hash_page(cpu, page);
+  }
+
+  return combine(cpu, ram_hash);
+}
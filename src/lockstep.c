@@ -0,0 +1,308 @@
+#include "../include/lockstep.h"
+#include <string.h>
+#include "../include/debug.h"
+
+// Reads a byte of ROM. The address must be below 0x8000.
+static uint8_t read_rom(const cpu_t* cpu, const uint16_t addr) {
+  if (addr <= 0x3FFF) {
+    return cpu->mem.rom_bank_0[addr];
+  }
+  return cpu->mem.rom_bank_N[addr - 0x4000];
+}
+
+// Copies the registers of the lane's backing cpu_t into the lane arrays
+static void load_lane(lockstep_t* ls, const size_t lane) {
+  const cpu_t* cpu = ls->cpus[lane];
+  ls->r8[0][lane] = cpu->regs.bc.b;
+  ls->r8[1][lane] = cpu->regs.bc.c;
+  ls->r8[2][lane] = cpu->regs.de.d;
+  ls->r8[3][lane] = cpu->regs.de.e;
+  ls->r8[4][lane] = cpu->regs.hl.h;
+  ls->r8[5][lane] = cpu->regs.hl.l;
+  ls->r8[7][lane] = cpu->regs.af.a;
+  ls->f[lane] = cpu->regs.af.f.reg;
+  ls->sp[lane] = cpu->regs.sp;
+  ls->pc[lane] = cpu->regs.pc;
+  ls->cycles[lane] = cpu->cycles;
+}
+
+// Copies the lane arrays back into the lane's backing cpu_t
+static void store_lane(const lockstep_t* ls, const size_t lane) {
+  cpu_t* cpu = ls->cpus[lane];
+  cpu->regs.bc.b = ls->r8[0][lane];
+  cpu->regs.bc.c = ls->r8[1][lane];
+  cpu->regs.de.d = ls->r8[2][lane];
+  cpu->regs.de.e = ls->r8[3][lane];
+  cpu->regs.hl.h = ls->r8[4][lane];
+  cpu->regs.hl.l = ls->r8[5][lane];
+  cpu->regs.af.a = ls->r8[7][lane];
+  cpu->regs.af.f.reg = ls->f[lane];
+  cpu->regs.sp = ls->sp[lane];
+  cpu->regs.pc = ls->pc[lane];
+  cpu->cycles = ls->cycles[lane];
+}
+
+bool lockstep_init(lockstep_t* ls, cpu_t** cpus, size_t count) {
+  if (count == 0 || count > LOCKSTEP_MAX_LANES) {
+    return false;
+  }
+
+  memset(ls, 0, sizeof(*ls));
+  for (size_t i = 0; i < count; i++) {
+    // Opcodes are fetched once per group, so every lane must see the same ROM
+    if (memcmp(cpus[i]->mem.rom_bank_0, cpus[0]->mem.rom_bank_0,
+               ROM_BANK_SIZE) != 0 ||
+        memcmp(cpus[i]->mem.rom_bank_N, cpus[0]->mem.rom_bank_N,
+               ROM_BANK_SIZE) != 0) {
+      return false;
+    }
+
+    ls->cpus[i] = cpus[i];
+    load_lane(ls, i);
+  }
+  ls->lanes = count;
+
+  return true;
+}
+
+void lockstep_sync(lockstep_t* ls) {
+  for (size_t i = 0; i < ls->lanes; i++) {
+    store_lane(ls, i);
+  }
+}
+
+// Adds delta to the r16 register YY of every masked lane
+static void add_r16(lockstep_t* ls, const uint8_t YY, const uint16_t delta) {
+  const uint8_t* m = ls->mask;
+  if (YY == 3) {
+    uint16_t* sp = ls->sp;
+    for (size_t i = 0; i < ls->lanes; i++) {
+      sp[i] += m[i] ? delta : 0;
+    }
+    return;
+  }
+
+  uint8_t* hi = ls->r8[YY * 2];
+  uint8_t* lo = ls->r8[YY * 2 + 1];
+  for (size_t i = 0; i < ls->lanes; i++) {
+    const uint16_t val = ((hi[i] << 8) | lo[i]) + (m[i] ? delta : 0);
+    hi[i] = val >> 8;
+    lo[i] = val & 0xFF;
+  }
+}
+
+// Sets the r16 register YY of every masked lane to val
+static void set_r16(lockstep_t* ls, const uint8_t YY, const uint16_t val) {
+  const uint8_t* m = ls->mask;
+  if (YY == 3) {
+    uint16_t* sp = ls->sp;
+    for (size_t i = 0; i < ls->lanes; i++) {
+      sp[i] = m[i] ? val : sp[i];
+    }
+    return;
+  }
+
+  uint8_t* hi = ls->r8[YY * 2];
+  uint8_t* lo = ls->r8[YY * 2 + 1];
+  for (size_t i = 0; i < ls->lanes; i++) {
+    hi[i] = m[i] ? (val >> 8) : hi[i];
+    lo[i] = m[i] ? (val & 0xFF) : lo[i];
+  }
+}
+
+// add hl, r16 for every masked lane
+static void add_hl_r16(lockstep_t* ls, const uint8_t YY) {
+  const uint8_t* m = ls->mask;
+  uint8_t* h = ls->r8[4];
+  uint8_t* l = ls->r8[5];
+  uint8_t* f = ls->f;
+
+  for (size_t i = 0; i < ls->lanes; i++) {
+    const uint16_t hl = (h[i] << 8) | l[i];
+    const uint16_t r16 =
+        YY == 3 ? ls->sp[i] : (ls->r8[YY * 2][i] << 8) | ls->r8[YY * 2 + 1][i];
+    const uint32_t sum = hl + r16;
+    const uint8_t flags = (f[i] & (FLAG_Z | 0x0F)) |
+                          (((hl & 0xFFF) + (r16 & 0xFFF)) > 0xFFF ? FLAG_H : 0) |
+                          (sum > 0xFFFF ? FLAG_C : 0);
+
+    h[i] = m[i] ? (sum >> 8) & 0xFF : h[i];
+    l[i] = m[i] ? sum & 0xFF : l[i];
+    f[i] = m[i] ? flags : f[i];
+  }
+}
+
+// inc r8/dec r8 for every masked lane
+static void step_r8(lockstep_t* ls, const uint8_t YYZ, const bool inc) {
+  const uint8_t* m = ls->mask;
+  uint8_t* r8 = ls->r8[YYZ];
+  uint8_t* f = ls->f;
+
+  for (size_t i = 0; i < ls->lanes; i++) {
+    const uint8_t old = r8[i];
+    const uint8_t val = inc ? old + 1 : old - 1;
+    const bool set_h = inc ? (old & 0xF) == 0xF : (old & 0xF) == 0;
+    const uint8_t flags = (f[i] & (FLAG_C | 0x0F)) | (val == 0 ? FLAG_Z : 0) |
+                          (inc ? 0 : FLAG_N) | (set_h ? FLAG_H : 0);
+
+    r8[i] = m[i] ? val : old;
+    f[i] = m[i] ? flags : f[i];
+  }
+}
+
+// jr/jr cond, imm8 for every masked lane. cond is -1 for an unconditional jump
+static void jump_relative(lockstep_t* ls, const int cond, const int8_t imm8) {
+  const uint8_t* m = ls->mask;
+  const uint8_t* f = ls->f;
+  uint16_t* pc = ls->pc;
+
+  for (size_t i = 0; i < ls->lanes; i++) {
+    bool taken;
+    switch (cond) {
+      case 0:  // nz
+        taken = (f[i] & FLAG_Z) == 0;
+        break;
+      case 1:  // z
+        taken = (f[i] & FLAG_Z) != 0;
+        break;
+      case 2:  // nc
+        taken = (f[i] & FLAG_C) == 0;
+        break;
+      case 3:  // c
+        taken = (f[i] & FLAG_C) != 0;
+        break;
+      default:
+        taken = true;
+    }
+    pc[i] += (m[i] && taken) ? imm8 : 0;
+  }
+}
+
+/**
+ * Executes the opcode at pc for every masked lane. Returns false without
+ * touching any lane if the opcode has no lane kernel and must be run through
+ * perform_cycle instead. The behaviour of each kernel matches perform_cycle.
+ */
+static bool run_lane_kernel(lockstep_t* ls, const uint16_t pc) {
+  const cpu_t* cpu = ls->cpus[0];
+  const uint8_t opcode = read_rom(cpu, pc);
+  const uint8_t imm8 = read_rom(cpu, pc + 1);
+  const uint16_t imm16 = imm8 | (read_rom(cpu, pc + 2) << 8);
+  const uint8_t YY = (opcode >> 4) & 0b11;
+  const uint8_t YYZ = (opcode >> 3) & 0b111;
+  const uint8_t ZZZ = opcode & 0b111;
+  const uint8_t* m = ls->mask;
+  const size_t n = ls->lanes;
+
+  if ((opcode >> 6) == 1) {  // ld r8, r8
+    if (opcode == 0x76 || YYZ == 6 || ZZZ == 6) {  // halt and [hl] operands
+      return false;
+    }
+
+    uint8_t* dest = ls->r8[YYZ];
+    const uint8_t* src = ls->r8[ZZZ];
+    for (size_t i = 0; i < n; i++) {
+      dest[i] = m[i] ? src[i] : dest[i];
+    }
+  } else if (opcode == 0x00) {  // nop
+  } else if ((opcode & 0xCF) == 0x01) {  // ld r16, imm16
+    set_r16(ls, YY, imm16);
+  } else if ((opcode & 0xCF) == 0x03) {  // inc r16
+    add_r16(ls, YY, 1);
+  } else if ((opcode & 0xCF) == 0x0B) {  // dec r16
+    add_r16(ls, YY, 0xFFFF);
+  } else if ((opcode & 0xCF) == 0x09) {  // add hl, r16
+    add_hl_r16(ls, YY);
+  } else if ((opcode & 0xC7) == 0x04 && YYZ != 6) {  // inc r8
+    step_r8(ls, YYZ, true);
+  } else if ((opcode & 0xC7) == 0x05 && YYZ != 6) {  // dec r8
+    step_r8(ls, YYZ, false);
+  } else if ((opcode & 0xC7) == 0x06 && YYZ != 6) {  // ld r8, imm8
+    uint8_t* dest = ls->r8[YYZ];
+    for (size_t i = 0; i < n; i++) {
+      dest[i] = m[i] ? imm8 : dest[i];
+    }
+  } else if (opcode == 0x2F) {  // cpl
+    uint8_t* a = ls->r8[7];
+    uint8_t* f = ls->f;
+    for (size_t i = 0; i < n; i++) {
+      a[i] = m[i] ? ~a[i] : a[i];
+      f[i] |= m[i] ? (FLAG_N | FLAG_H) : 0;
+    }
+  } else if (opcode == 0x37 || opcode == 0x3F) {  // scf/ccf
+    uint8_t* f = ls->f;
+    for (size_t i = 0; i < n; i++) {
+      const uint8_t flags = opcode == 0x37
+                                ? (f[i] & (FLAG_Z | 0x0F)) | FLAG_C
+                                : (f[i] & (FLAG_Z | FLAG_C | 0x0F)) ^ FLAG_C;
+      f[i] = m[i] ? flags : f[i];
+    }
+  } else if (opcode == 0x18) {  // jr imm8
+    jump_relative(ls, -1, (int8_t)imm8);
+  } else if ((opcode & 0xE7) == 0x20) {  // jr cond, imm8
+    jump_relative(ls, (opcode >> 3) & 0b11, (int8_t)imm8);
+  } else {
+    return false;
+  }
+
+  // Equivalent of update_cpu
+  const uint8_t length = get_unprefixed_insn_length(opcode);
+  const uint8_t cycles = get_unprefixed_insn_cycles(opcode);
+  for (size_t i = 0; i < n; i++) {
+    ls->pc[i] += m[i] ? length : 0;
+    ls->cycles[i] += m[i] ? cycles : 0;
+  }
+
+  return true;
+}
+
+// Whether the lane's instance must not run, for the same reasons run_frame stops
+static bool is_lane_stopped(const lockstep_t* ls, const size_t lane) {
+  const cpu_t* cpu = ls->cpus[lane];
+  return cpu->fault || (cpu->dbg != NULL && cpu->dbg->stopped);
+}
+
+size_t lockstep_step(lockstep_t* ls) {
+  const size_t n = ls->lanes;
+
+  // Lead with the lane that is furthest behind so lanes stay close in time
+  size_t lead = n;
+  for (size_t i = 0; i < n; i++) {
+    if (!is_lane_stopped(ls, i) &&
+        (lead == n || ls->cycles[i] < ls->cycles[lead])) {
+      lead = i;
+    }
+  }
+  if (lead == n) {
+    return 0;
+  }
+
+  const uint16_t pc = ls->pc[lead];
+  size_t active = 0;
+  bool debugging = false;
+  for (size_t i = 0; i < n; i++) {
+    ls->mask[i] = ls->pc[i] == pc && !is_lane_stopped(ls, i);
+    active += ls->mask[i];
+    debugging |= ls->mask[i] && (ls->cpus[i]->dbg != NULL ||
+                                 ls->cpus[i]->coverage != NULL);
+  }
+
+  // Only opcodes (and their immediates) fetched from ROM are shared by lanes,
+  // and lanes with a debugger or coverage map need perform_cycle to see every instruction
+  if (active > 1 && !debugging && pc <= 0x7FFD && run_lane_kernel(ls, pc)) {
+    ls->vector_insns += active;
+    return active;
+  }
+
+  // Diverged or unsupported, run each lane of the group on its own
+  for (size_t i = 0; i < n; i++) {
+    if (ls->mask[i]) {
+      store_lane(ls, i);
+      perform_cycle(ls->cpus[i]);
+      load_lane(ls, i);
+    }
+  }
+  ls->scalar_insns += active;
+
+  return active;
+}
@@ -1,5 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/cpu.h"
+#include "../include/export.h"
+#include "../include/fuzz.h"
+#include "../include/utils.h"
+
+static void print_usage(char* program) {
+  fprintf(stderr,
+          "Usage: %s <cartridge> [-f frames] [-e shm_name] [-a] [-v] [-z execs]\n"
+          "  -f frames    Number of frames to run, runs forever if omitted\n"
+          "  -e shm_name  Export frames through a shared memory ring (e.g. "
+          "/emuboy)\n"
+          "  -a           Accurate timing, do not fast-forward idle loops\n"
+          "  -v           Report the idle cycles skipped in each frame\n"
+          "  -z execs     Fuzz joypad inputs for execs runs, reporting inputs "
+          "that access\n"
+          "               invalid memory locations\n",
+          program);
+}
+
+// Set by SIGINT/SIGTERM so that the main loop exits and cleans up
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static void install_stop_handlers(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
+static double now_secs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fuzzes the cpu from its current state and prints every new finding
+static int run_fuzzer(cpu_t* cpu, uint64_t execs) {
+  fuzzer_t* fz = malloc(sizeof(fuzzer_t));
+  if (fz == NULL || fuzz_init(fz, cpu, (uint64_t)time(NULL)) != CPU_OK) {
+    fprintf(stderr, "Could not set up fuzzer: %s\n",
+            cpu_strerror(CPU_ERR_NO_MEMORY));
+    free(fz);
+    return EXIT_FAILURE;
+  }
+
+  const double start = now_secs();
+  for (uint64_t i = 0; i < execs && !stop_requested; i++) {
+    const fuzz_finding_t* finding = fuzz_step(fz);
+    if (finding == NULL) {
+      continue;
+    }
+
+    printf("Invalid memory location 0x%04X at PC 0x%04X, input:",
+           finding->addr, finding->pc);
+    for (size_t frame = 0; frame < finding->input.len; frame++) {
+      printf(" %02X", finding->input.frames[frame]);
+    }
+    printf("\n");
+  }
+  const double secs = now_secs() - start;
+
+  printf("%llu execs in %.2fs (%.0f/s), %zu edges, %zu inputs in corpus, %zu "
+         "findings\n",
+         (unsigned long long)fz->execs, secs, secs > 0 ? fz->execs / secs : 0,
+         fz->edges, fz->corpus_count, fz->finding_count);
+
+  fuzz_cleanup(fz);
+  free(fz);
+  return 0;
+}
+
 int main(int argc, char* argv[]) {
-  (void)argc;
-  (void)argv;
+  if (argc < 2) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  char* cart_file = argv[1];
+  uint64_t frames = 0;
+  char* shm_name = NULL;
+  bool accurate = false;
+  bool verbose = false;
+  uint64_t fuzz_execs = 0;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      frames = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      shm_name = argv[++i];
+    } else if (strcmp(argv[i], "-a") == 0) {
+      accurate = true;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+      fuzz_execs = strtoull(argv[++i], NULL, 10);
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  cpu_t* cpu;
+  const cpu_err_t err = init_cpu(&cpu, cart_file);
+  if (err != CPU_OK) {
+    fprintf(stderr, "Could not load %s: %s\n", cart_file, cpu_strerror(err));
+    return EXIT_FAILURE;
+  }
+  cpu->idle_skip = !accurate;
+  install_stop_handlers();
+
+  if (fuzz_execs != 0) {
+    const int status = run_fuzzer(cpu, fuzz_execs);
+    cleanup_cpu(cpu);
+    return status;
+  }
+
+  export_ring_t* ring = NULL;
+  if (shm_name != NULL && !export_create(shm_name, &ring)) {
+    if (errno == EEXIST) {
+      fprintf(stderr,
+              "Shared memory ring %s already exists, another emulator may be "
+              "using it\n",
+              shm_name);
+    } else {
+      PERRORF("Could not create shared memory ring %s", shm_name);
+    }
+    cleanup_cpu(cpu);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t frame_num;
+  for (frame_num = 0; (frames == 0 || frame_num < frames) && !stop_requested;
+       frame_num++) {
+    // The frame is produced in place in the ring slot, so nothing is copied
+    export_frame_t* frame = ring != NULL ? export_acquire_frame(ring) : NULL;
+
+    const uint64_t idle_cycles = cpu->idle_cycles;
+    const bool completed = run_frame(cpu);
+    if (verbose) {
+      printf("Frame %llu: skipped %llu idle cycles\n",
+             (unsigned long long)frame_num,
+             (unsigned long long)(cpu->idle_cycles - idle_cycles));
+    }
+
+    if (frame != NULL) {
+      frame->seq = frame_num;
+      frame->cycles = cpu->cycles;
+      export_publish_frame(ring);
+    }
+
+    if (!completed) {
+      fprintf(stderr,
+              "Attempted to access invalid memory location 0x%04X at PC "
+              "0x%04X\n",
+              cpu->fault_addr, cpu->fault_pc);
+      break;
+    }
+  }
+
+  printf("Skipped %llu of %llu cycles in idle loops (%llu per frame)\n",
+         (unsigned long long)cpu->idle_cycles, (unsigned long long)cpu->cycles,
+         (unsigned long long)(frame_num ? cpu->idle_cycles / frame_num : 0));
+  if (ring != NULL) {
+    printf("Exported %llu frames, dropped %llu\n",
+           (unsigned long long)ring->frame_head,
+           (unsigned long long)ring->frame_dropped);
+    export_destroy(ring, shm_name);
+  }
+  cleanup_cpu(cpu);
+
   return 0;
-}
\ No newline at end of file
+}